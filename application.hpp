@@ -4,6 +4,8 @@
 #include "message.hpp"
 #include "time.hpp"
 #include "callback.hpp"
+#include "scheduler.hpp"
+#include "snapshot.hpp"
 
 #include "random.h"
 
@@ -25,6 +27,35 @@ template <typename A> class Application {
 protected:
 	A address = 0;
 	unsigned long randomTag();
+
+	/**
+	 * This application's own random number stream. Applications
+	 * can be ticked on different threads, so they must not share
+	 * one.
+	 */
+	Random::Generator rng;
+
+	/**
+	 * The network this application lives on. It keeps the time
+	 * and decides when this application gets ticked.
+	 */
+	Scheduler<A>* scheduler = nullptr;
+
+	/** The current network time. */
+	Time now() { return this->scheduler ? this->scheduler->now() : 0; }
+
+	/** The biggest message the network will deliver, in bytes. */
+	size_t maxMessageSize() {
+		return this->scheduler ? this->scheduler->maxMessageSize()
+		                       : std::numeric_limits<size_t>::max();
+	}
+
+	/** Ask the network to tick this application at the given time. */
+	void wakeAt(Time time) {
+		if (this->scheduler) {
+			this->scheduler->wakeAt(this->address, time);
+		}
+	}
 public:
 
         Application();
@@ -56,6 +87,14 @@ public:
 	 */
 	virtual void tick(Time time) = 0;
 
+	/**
+	 * The next time this application needs to be ticked even if
+	 * no messages arrive for it (retry deadlines, periodic
+	 * maintenance, ...). This is called by the network after
+	 * every tick. NEVER means "only when a message arrives".
+	 */
+	virtual Time nextWakeup() { return NEVER; }
+
 	/**
 	 * A setter to be possibly overriden, as changing addresses
 	 * should be handled with care.
@@ -63,6 +102,20 @@ public:
 	void setAddress(A newAddress) { this->address = newAddress; }
         A getAddress() { return this->address; }
 
+	/** Called by the network when this application joins it. */
+	void setScheduler(Scheduler<A>* newScheduler) { this->scheduler = newScheduler; }
+
+	/**
+	 * Save this application's state to a snapshot. Subclasses
+	 * save their own state and then call up to their parent's.
+	 */
+	virtual void save(SnapshotWriter& out) { out.generator(this->rng); }
+	/**
+	 * Read back what save wrote, into a freshly made application
+	 * that the network has already given its address.
+	 */
+	virtual void restore(SnapshotReader& in) { in.generator(this->rng); }
+
 	/**
 	 * Kill this node. It will no longer do anything.
 	 */
@@ -73,11 +126,12 @@ public:
 	virtual bool isDead() = 0;
 };
 
-template <typename A> Application<A>::Application() {
+template <typename A> Application<A>::Application()
+	: rng(global_rng.Bits_64()) {
 }
 
 template <typename A> unsigned long Application<A>::randomTag() {
-	return global_rng.Number((unsigned long)0, std::numeric_limits<unsigned long>::max());
+	return this->rng.Number((unsigned long)0, std::numeric_limits<unsigned long>::max());
 }
 
 }
@@ -5,25 +5,31 @@
 #include "message.hpp"
 #include "time.hpp"
 #include "callback.hpp"
+#include "log.hpp"
+#include "timer_wheel.hpp"
+#include "metrics.hpp"
+#include "fifo.hpp"
 
-#include <map>
+#include <unordered_map>
 #include <iostream>
 #include <optional>
 #include <functional>
+#include <algorithm>
+#include <utility>
 
 namespace dhtsim {
 template <typename A> class BaseApplication : public Application<A> {
 public:
 	using SendCallbackSet = CallbackSet<Message<A>, Message<A>>;
 
-        BaseApplication() : epoch(0),
-                            inqueue(), outqueue(),
+        BaseApplication() : inqueue(), outqueue(),
                             callbacks() {}
 
-        virtual void recv(Message<A> m) { this->queueIn(m); }
+        virtual void recv(Message<A> m) { this->queueIn(std::move(m)); }
 	virtual std::optional<Message<A>> unqueueOut();
 	virtual void handleMessage(const Message<A>& m);
 	virtual void tick(Time time);
+	virtual Time nextWakeup();
         /**
          * Send a message.
          * @param {m} The message to send.
@@ -39,16 +45,27 @@ public:
         virtual void die() { this->dead = true; }
         virtual bool isDead() { return this->dead; }
 
-protected:
-        /** The current network's time. */
-        Time epoch;
+	virtual void save(SnapshotWriter& out);
+	virtual void restore(SnapshotReader& in);
 
+protected:
 	/** Is this node dead? */
 	bool dead = false;
 
-	std::queue<Message<A>> inqueue, outqueue;
+	Fifo<Message<A>> inqueue, outqueue;
 	void queueIn(Message<A> m);
 	void queueOut(Message<A> m);
+
+	/**
+	 * The callbacks for a message that was waiting for a response
+	 * when a snapshot was taken. Callbacks can't be saved, so the
+	 * application has to make them again from the message it
+	 * sent; by default there are none.
+	 */
+	virtual SendCallbackSet reviveCallback(const Message<A>& m) {
+		(void) m;
+		return SendCallbackSet();
+	}
 private:
 
 	/* This section is for variables that configure this
@@ -97,7 +114,7 @@ private:
 		SentMessage() = default;
                 SentMessage(Message<A> m, SendCallbackSet cbf, Time time,
                             unsigned long timeout, unsigned int maxRetries)
-			: message(m), callback(cbf), timeSent(time),
+			: message(std::move(m)), callback(std::move(cbf)), timeSent(time),
 			  nextSend(time + timeout), retries(0), maxRetries(maxRetries) {}
 
 		bool needsRetry() {
@@ -115,7 +132,7 @@ private:
 			this->retries++;
 		}
 
-		void success(Message<A> m) {
+		void success(const Message<A>& m) {
 			this->callback.success(m);
 		}
 
@@ -126,13 +143,43 @@ private:
 
 	void attemptRetry(SentMessage& record);
 
+	/** How many retries a message took, for the metrics. */
+	static void recordRetries(unsigned long retries) {
+		static const auto id = Metrics::global().histogram("app.send_retries");
+		Metrics::global().record(id, retries);
+	}
+
 	/**
 	 * A map of message tags to "sent message" records. When a
 	 * message is received and its tag matches one of the keys,
 	 * the callback function is called with the message as its
 	 * parameter.
 	 */
-	std::map<unsigned long, SentMessage> callbacks;
+	std::unordered_map<unsigned long, SentMessage> callbacks;
+
+	/**
+	 * Nodes of callbacks whose records are done with, kept so that
+	 * new records reuse them instead of allocating.
+	 */
+	std::vector<typename decltype(callbacks)::node_type> spareRecords;
+
+	/** Take the record out of callbacks, keeping its node for later. */
+	SentMessage retire(typename decltype(callbacks)::iterator it) {
+		auto node = this->callbacks.extract(it);
+		SentMessage record = std::move(node.mapped());
+		node.mapped() = SentMessage();
+		this->spareRecords.push_back(std::move(node));
+		return record;
+	}
+
+	/**
+	 * The tags in callbacks, filed under their records'
+	 * nextSend. Only timers that come due are looked at in tick.
+	 */
+	TimerWheel<unsigned long> retryTimers;
+
+	/** Scratch space for the timers that came due in tick. */
+	std::vector<unsigned long> dueTags;
 
 };
 
@@ -142,7 +189,7 @@ template <typename A> std::optional<Message<A>> BaseApplication<A>::unqueueOut()
 		return {};
 	}
 
-	auto message = this->outqueue.front();
+	auto message = std::move(this->outqueue.front());
 	this->outqueue.pop();
 	
 	return message;
@@ -150,9 +197,9 @@ template <typename A> std::optional<Message<A>> BaseApplication<A>::unqueueOut()
 
 template <typename A> void BaseApplication<A>::queueIn(Message<A> m) {
 	if (this->inqueue.size() < this->inqueueLimit) {
-		this->inqueue.push(m);
+		this->inqueue.push(std::move(m));
 	} else {
-		std::clog << "[" << this->getAddress() << "]"
+		logStream() << "[" << this->getAddress() << "]"
 		          << " Input queue full, dropping packet."
 		          << std::endl;
 	}
@@ -160,9 +207,11 @@ template <typename A> void BaseApplication<A>::queueIn(Message<A> m) {
 
 template <typename A> void BaseApplication<A>::queueOut(Message<A> m) {
 	if (this->outqueue.size() < this->outqueueLimit) {
-		this->outqueue.push(m);
+		this->outqueue.push(std::move(m));
+		// Make sure the network comes around to pick it up.
+		this->wakeAt(this->now());
 	} else {
-		std::clog << "[" << this->getAddress() << "]"
+		logStream() << "[" << this->getAddress() << "]"
 		          << " Output queue full, dropping packet."
 		          << std::endl;
 	}
@@ -173,19 +222,21 @@ template <typename A> void BaseApplication<A>::attemptRetry(SentMessage& record)
 	// without a callback!.
 	this->send(record.message);
 	// Let the record know about the retry.
-	record.retry(this->epoch, this->backoffFactor);
+	record.retry(this->now(), this->backoffFactor);
 }
 
 template <typename A> void BaseApplication<A>::tick(Time time) {
 	// Dead nodes send no messages.
 	if (this->dead) return;
 
-	// Update our record of the time.
-	this->epoch = time;
+	static const auto inqueueDepth = Metrics::global().histogram("app.inqueue");
+	static const auto outqueueDepth = Metrics::global().histogram("app.outqueue");
+	static const auto outstanding = Metrics::global().histogram("app.callbacks");
+	Metrics::global().record(inqueueDepth, this->inqueue.size());
 
 	// handle inbound messages
 	while (!this->inqueue.empty()) {
-		auto message = this->inqueue.front();
+		auto message = std::move(this->inqueue.front());
 		// std::clog << this->getAddress()
 		//           << " got a message from "
 		//           << message.originator
@@ -195,24 +246,37 @@ template <typename A> void BaseApplication<A>::tick(Time time) {
 		this->handleMessage(message);
 	}
 
-	// Check for messages whose responses are overdue
-	auto it = this->callbacks.begin();
-	for ( ; it != this->callbacks.end(); ) {
-		auto& [idx, record] = *it;
+	// Check for messages whose responses are overdue. They are
+	// handled in tag order, like the old ordered map walk did.
+	this->dueTags.clear();
+	this->retryTimers.advance(time, this->dueTags);
+	std::sort(this->dueTags.begin(), this->dueTags.end());
+	for (auto tag : this->dueTags) {
+		auto it = this->callbacks.find(tag);
+		if (it == this->callbacks.end()) continue;
+		auto& record = it->second;
 		// Is the message overdue for re-sending?
-		if (this->epoch >= record.nextSend) {
-			if (record.needsRetry()) {
-				this->attemptRetry(record);
-			} else {
-				record.failure();
-				it = this->callbacks.erase(it);
-				continue;
-			}
+		if (time < record.nextSend) continue;
+
+		if (record.needsRetry()) {
+			this->attemptRetry(record);
+			this->retryTimers.schedule(record.nextSend, tag);
+		} else {
+			SentMessage failed = this->retire(it);
+			recordRetries(failed.retries);
+			failed.failure();
 		}
-
-		it++;
 	}
-	
+
+	Metrics::global().record(outqueueDepth, this->outqueue.size());
+	Metrics::global().record(outstanding, this->callbacks.size());
+}
+
+template <typename A> Time BaseApplication<A>::nextWakeup() {
+	if (this->dead) return NEVER;
+
+	// The earliest retry deadline.
+	return this->retryTimers.next();
 }
 
 template <typename A> void BaseApplication<A>::send(
@@ -239,20 +303,102 @@ template <typename A> void BaseApplication<A>::send(
 	}
 
 	if (!callback.empty()) {
-		SentMessage sentmsg(m, callback, this->epoch, timeout, maxRetries);
-		this->callbacks[m.tag] = sentmsg;
+		// The record shares the message's payload, it doesn't
+		// copy it.
+		auto old = this->callbacks.find(m.tag);
+		if (old != this->callbacks.end()) {
+			this->retryTimers.cancel(old->second.nextSend, m.tag);
+		}
+		// The timeout runs from now(). Between ticks that is the
+		// epoch the message goes out in, not the one that just
+		// ended, so a request made between ticks has its whole
+		// timeout to hear back.
+		SentMessage sentmsg(m, std::move(callback), this->now(), timeout, maxRetries);
+		this->retryTimers.schedule(sentmsg.nextSend, m.tag);
+		if (old != this->callbacks.end()) {
+			old->second = std::move(sentmsg);
+		} else if (!this->spareRecords.empty()) {
+			auto node = std::move(this->spareRecords.back());
+			this->spareRecords.pop_back();
+			node.key() = m.tag;
+			node.mapped() = std::move(sentmsg);
+			this->callbacks.insert(std::move(node));
+		} else {
+			this->callbacks.emplace(m.tag, std::move(sentmsg));
+		}
+	}
+
+	this->queueOut(std::move(m));
+}
+
+template <typename A> void BaseApplication<A>::save(SnapshotWriter& out) {
+	out.pod(this->dead);
+	for (auto queue : {this->inqueue, this->outqueue}) {
+		out.u64(queue.size());
+		for (; !queue.empty(); queue.pop()) {
+			out.message(queue.front());
+		}
+	}
+
+	// Pending responses, as data, in tag order so the same state
+	// always makes the same file.
+	std::vector<unsigned long> tags;
+	tags.reserve(this->callbacks.size());
+	for (const auto& entry : this->callbacks) {
+		tags.push_back(entry.first);
+	}
+	std::sort(tags.begin(), tags.end());
+	out.u64(tags.size());
+	for (auto tag : tags) {
+		const auto& record = this->callbacks.find(tag)->second;
+		out.message(record.message);
+		out.pod(record.timeSent);
+		out.pod(record.nextSend);
+		out.pod(record.retries);
+		out.pod(record.maxRetries);
+	}
+
+	Application<A>::save(out);
+}
+
+template <typename A> void BaseApplication<A>::restore(SnapshotReader& in) {
+	in.pod(this->dead);
+	for (auto queue : {&this->inqueue, &this->outqueue}) {
+		uint64_t n = in.count(1);
+		for (uint64_t i = 0; i < n && !in.failed(); i++) {
+			queue->push(in.message<A>());
+		}
+	}
+
+	uint64_t n = in.count(1);
+	for (uint64_t i = 0; i < n && !in.failed(); i++) {
+		SentMessage record;
+		record.message = in.message<A>();
+		in.pod(record.timeSent);
+		in.pod(record.nextSend);
+		in.pod(record.retries);
+		in.pod(record.maxRetries);
+		auto tag = record.message.tag;
+		this->retryTimers.schedule(record.nextSend, tag);
+		this->callbacks.insert_or_assign(tag, std::move(record));
 	}
 
-	this->queueOut(m);
+	Application<A>::restore(in);
+
+	// Only now is everything the callbacks may need back.
+	for (auto& entry : this->callbacks) {
+		entry.second.callback = this->reviveCallback(entry.second.message);
+	}
 }
 
 template <typename A> void BaseApplication<A>::handleMessage(const Message<A>& m) {
 	auto tag = m.tag;
 	auto it = this->callbacks.find(tag);
 	if (it != this->callbacks.end()) {
-		auto [tag, sentrecord] = *it;
+		SentMessage sentrecord = this->retire(it);
+		this->retryTimers.cancel(sentrecord.nextSend, tag);
+		recordRetries(sentrecord.retries);
 		sentrecord.success(m);
-		this->callbacks.erase(it);
 	}
 }
 
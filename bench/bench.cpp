@@ -0,0 +1,248 @@
+#include "bench/bench.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <new>
+#include <sstream>
+
+#include "argh.h"
+
+using namespace dhtsim;
+
+/*
+ * Every operator new in the program comes through here, so the
+ * benchmarks can count allocations. The nothrow forms call these.
+ */
+static std::atomic<uint64_t> allocated{0};
+
+static void* counted(size_t size, size_t alignment) {
+	allocated.fetch_add(1, std::memory_order_relaxed);
+	size = std::max<size_t>(size, 1);
+	void* p = alignment <= alignof(std::max_align_t)
+		? std::malloc(size)
+		: std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+	// Built without exceptions, so there's no bad_alloc to throw.
+	if (!p) std::abort();
+	return p;
+}
+
+void* operator new(size_t size) { return counted(size, 0); }
+void* operator new[](size_t size) { return counted(size, 0); }
+void* operator new(size_t size, std::align_val_t a) { return counted(size, size_t(a)); }
+void* operator new[](size_t size, std::align_val_t a) { return counted(size, size_t(a)); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { std::free(p); }
+
+uint64_t dhtsim::allocations() {
+	return allocated.load(std::memory_order_relaxed);
+}
+
+void BenchSuite::report(const std::string& name, double value, const std::string& unit,
+                        bool higherIsBetter, double allocsPerOp) {
+	this->list.push_back({name, value, unit, higherIsBetter, allocsPerOp});
+	std::clog << std::left << std::setw(48) << name << " "
+	          << std::right << std::setw(14) << std::fixed << std::setprecision(2) << value
+	          << " " << unit;
+	if (allocsPerOp >= 0) {
+		std::clog << std::setw(10) << allocsPerOp << " allocs/op";
+	}
+	std::clog << std::endl;
+}
+
+void BenchSuite::expectNoAllocations(const std::string& name, uint64_t allocs) {
+	this->expect(name, allocs == 0, std::to_string(allocs) + " allocs");
+}
+
+void BenchSuite::expect(const std::string& name, bool ok, const std::string& what) {
+	if (!this->wanted(name)) return;
+	std::clog << std::left << std::setw(48) << name << " " << std::right << std::setw(20)
+	          << what << (ok ? "" : "  FAILED") << std::endl;
+	if (!ok) this->failed++;
+}
+
+/*
+ * The JSON is one object with a "benchmarks" array, one object per
+ * result with its fields always in the same order. readJson only
+ * understands what writeJson writes.
+ */
+bool BenchSuite::writeJson(const std::string& path) const {
+	std::ofstream out(path);
+	if (!out) return false;
+	out << "{\n  \"benchmarks\": [";
+	for (size_t i = 0; i < this->list.size(); i++) {
+		const auto& r = this->list[i];
+		out << (i == 0 ? "\n" : ",\n")
+		    << "    {\"name\": \"" << r.name << "\", \"value\": "
+		    << std::setprecision(17) << r.value
+		    << ", \"unit\": \"" << r.unit << "\", \"higher_is_better\": "
+		    << (r.higherIsBetter ? "true" : "false");
+		if (r.allocsPerOp >= 0) {
+			out << ", \"allocs_per_op\": " << r.allocsPerOp;
+		}
+		out << "}";
+	}
+	out << "\n  ]\n}\n";
+	return bool(out);
+}
+
+/** The string value of "field": "..." in an object, or "". */
+static std::string stringField(const std::string& object, const std::string& field) {
+	auto at = object.find("\"" + field + "\": \"");
+	if (at == std::string::npos) return "";
+	at += field.size() + 5;
+	auto end = object.find('"', at);
+	return end == std::string::npos ? "" : object.substr(at, end - at);
+}
+
+bool BenchSuite::readJson(const std::string& path, std::vector<BenchResult>& results) {
+	std::ifstream in(path);
+	if (!in) return false;
+	std::stringstream text;
+	text << in.rdbuf();
+	std::string json = text.str();
+
+	auto at = json.find("\"benchmarks\"");
+	if (at == std::string::npos) return false;
+	results.clear();
+	while ((at = json.find('{', at + 1)) != std::string::npos) {
+		auto end = json.find('}', at);
+		if (end == std::string::npos) return false;
+		std::string object = json.substr(at, end - at);
+
+		BenchResult r;
+		r.name = stringField(object, "name");
+		r.unit = stringField(object, "unit");
+		auto value = object.find("\"value\": ");
+		if (r.name.empty() || value == std::string::npos) return false;
+		r.value = std::strtod(object.c_str() + value + 9, nullptr);
+		r.higherIsBetter = object.find("\"higher_is_better\": true") != std::string::npos;
+		auto allocs = object.find("\"allocs_per_op\": ");
+		if (allocs != std::string::npos) {
+			r.allocsPerOp = std::strtod(object.c_str() + allocs + 17, nullptr);
+		}
+		results.push_back(r);
+		at = end;
+	}
+	return true;
+}
+
+unsigned int BenchSuite::compare(const std::vector<BenchResult>& baseline, double tolerance,
+                                 std::ostream& os) const {
+	unsigned int regressions = 0;
+	os << std::left << std::setw(48) << "# name" << std::right
+	   << std::setw(14) << "baseline" << std::setw(14) << "current"
+	   << std::setw(10) << "change" << std::endl;
+	for (const auto& r : this->list) {
+		os << std::left << std::setw(48) << r.name << std::right << std::fixed
+		   << std::setprecision(2);
+		auto base = std::find_if(baseline.begin(), baseline.end(),
+		                         [&r](const BenchResult& b) { return b.name == r.name; });
+		if (base == baseline.end() || base->value == 0) {
+			os << std::setw(14) << "-" << std::setw(14) << r.value
+			   << std::setw(10) << "new" << std::endl;
+			continue;
+		}
+		double change = (r.value - base->value) / base->value * 100;
+		// How much worse, whichever way is worse for this one.
+		double worse = r.higherIsBetter ? -change : change;
+		os << std::setw(14) << base->value << std::setw(14) << r.value
+		   << std::setw(9) << std::showpos << change << std::noshowpos << "%";
+		// Allocation counts don't wobble like times do, so any
+		// increase counts.
+		bool allocates = r.allocsPerOp >= 0 && base->allocsPerOp >= 0
+			&& r.allocsPerOp > base->allocsPerOp + 1e-6;
+		if (worse > tolerance) {
+			os << "  REGRESSION";
+		}
+		if (allocates) {
+			os << "  MORE ALLOCATIONS (" << base->allocsPerOp << " -> "
+			   << r.allocsPerOp << " per op)";
+		}
+		if (worse > tolerance || allocates) {
+			regressions++;
+		}
+		os << std::endl;
+	}
+	return regressions;
+}
+
+/*
+ * Run the benchmarks. Results are printed to stderr as they come in;
+ * --json=FILE writes them out for later, and --compare=FILE checks
+ * them against a file written that way, exiting with status 1 if
+ * anything got more than --tolerance percent worse or allocates more.
+ * A failed check also exits with status 1.
+ */
+int main(int, char* argv[]) {
+	argh::parser cmdl(argv);
+
+	BenchSuite suite;
+	cmdl("filter", "") >> suite.filter;
+	cmdl("min-time", 0.2) >> suite.minTime;
+	cmdl("repeats", 3) >> suite.repeats;
+
+	std::string json_path, compare_path;
+	double tolerance;
+	cmdl("json") >> json_path;
+	cmdl("compare") >> compare_path;
+	cmdl("tolerance", 10) >> tolerance;
+
+	// Both halves run unless only one is asked for.
+	bool micro = cmdl["micro"] || !cmdl["macro"];
+	bool macro = cmdl["macro"] || !cmdl["micro"];
+
+	std::string nodes_list;
+	cmdl("nodes", "1000,10000") >> nodes_list;
+	std::vector<unsigned long> sizes;
+	std::stringstream items(nodes_list);
+	std::string item;
+	while (std::getline(items, item, ',')) {
+		sizes.push_back(std::strtoul(item.c_str(), nullptr, 10));
+		if (sizes.back() < 2) {
+			std::cerr << "Bad value for --nodes: " << item << std::endl;
+			return 2;
+		}
+	}
+	Time warmup, ticks;
+	unsigned int threads;
+	cmdl("warmup", 100) >> warmup;
+	cmdl("ticks", 200) >> ticks;
+	cmdl("threads", 1) >> threads;
+
+	std::vector<BenchResult> baseline;
+	if (!compare_path.empty() && !BenchSuite::readJson(compare_path, baseline)) {
+		std::cerr << "Can't read baseline " << compare_path << std::endl;
+		return 2;
+	}
+
+	if (micro) microBenchmarks(suite);
+	if (macro) macroBenchmarks(suite, sizes, warmup, ticks, threads);
+
+	if (!json_path.empty() && !suite.writeJson(json_path)) {
+		std::cerr << "Can't write " << json_path << std::endl;
+		return 2;
+	}
+	int status = 0;
+	if (suite.failures() > 0) {
+		std::cout << suite.failures() << " check(s) failed" << std::endl;
+		status = 1;
+	}
+	if (!compare_path.empty()) {
+		unsigned int regressions = suite.compare(baseline, tolerance, std::cout);
+		if (regressions > 0) {
+			std::cout << regressions << " regression(s) over " << tolerance
+			          << "% or with more allocations" << std::endl;
+			status = 1;
+		}
+	}
+	return status;
+}
@@ -0,0 +1,138 @@
+#ifndef DHTSIM_BENCH_H
+#define DHTSIM_BENCH_H
+
+#include "time.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace dhtsim {
+
+/** Keep the compiler from throwing away a value that was only computed to be timed. */
+template <typename T> inline void keep(const T& value) {
+	asm volatile("" : : "r"(&value) : "memory");
+}
+
+/**
+ * How many times the program has called operator new. bench.cpp
+ * replaces the global operator new to count them.
+ */
+uint64_t allocations();
+
+/**
+ * One measurement. Microbenchmarks are in nanoseconds per operation,
+ * where lower is better; macrobenchmarks are rates, where higher is.
+ * Microbenchmarks also count heap allocations per operation, which
+ * should never go up; allocsPerOp is negative where they weren't
+ * counted.
+ */
+struct BenchResult {
+	std::string name;
+	double value;
+	std::string unit;
+	bool higherIsBetter;
+	double allocsPerOp = -1;
+};
+
+/**
+ * Runs benchmarks and collects their results.
+ *
+ * A microbenchmark is a function that does its operation a given
+ * number of times. The suite calls it with more and more iterations
+ * until a call takes at least minTime seconds, then keeps the best of
+ * repeats calls at that count, so that a one-off hiccup doesn't look
+ * like a regression.
+ */
+class BenchSuite {
+public:
+	double minTime = 0.2;
+	unsigned int repeats = 3;
+	/** Only run benchmarks whose names contain this. */
+	std::string filter;
+
+	bool wanted(const std::string& name) const {
+		return name.find(this->filter) != std::string::npos;
+	}
+
+	template <typename Fn> void measure(const std::string& name, Fn fn) {
+		if (!this->wanted(name)) return;
+		uint64_t iterations = 1;
+		double seconds;
+		uint64_t allocs;
+		while ((seconds = timed(fn, iterations, allocs)) < this->minTime) {
+			// Aim a bit past minTime, but don't trust one
+			// very short call to predict a long one.
+			double scale = seconds > 0 ? this->minTime * 1.2 / seconds : 100;
+			iterations *= std::min(std::max(scale, 2.0), 100.0);
+		}
+		double best = seconds / iterations;
+		for (unsigned int i = 1; i < this->repeats; i++) {
+			uint64_t more;
+			best = std::min(best, timed(fn, iterations, more) / iterations);
+			allocs = std::min(allocs, more);
+		}
+		this->report(name, best * 1e9, "ns/op", false, double(allocs) / iterations);
+	}
+
+	/** Record a result measured some other way. */
+	void report(const std::string& name, double value, const std::string& unit,
+	            bool higherIsBetter, double allocsPerOp = -1);
+
+	/**
+	 * Check that something made no heap allocations. A failed
+	 * check is printed, and counted in failures().
+	 */
+	void expectNoAllocations(const std::string& name, uint64_t allocs);
+	/**
+	 * Check anything else: ok says whether it passed, and what is
+	 * printed next to the name either way.
+	 */
+	void expect(const std::string& name, bool ok, const std::string& what);
+	unsigned int failures() const { return this->failed; }
+
+	const std::vector<BenchResult>& results() const { return this->list; }
+
+	/** Write the results as JSON. Returns false if the file can't be written. */
+	bool writeJson(const std::string& path) const;
+	/** Read results written by writeJson. Returns false if it can't. */
+	static bool readJson(const std::string& path, std::vector<BenchResult>& results);
+
+	/**
+	 * Print each result next to its baseline, flagging the ones
+	 * that got worse by more than tolerance percent or allocate
+	 * more than they did. Returns how many did.
+	 */
+	unsigned int compare(const std::vector<BenchResult>& baseline, double tolerance,
+	                     std::ostream& os) const;
+
+private:
+	template <typename Fn> static double timed(Fn& fn, uint64_t iterations, uint64_t& allocs) {
+		uint64_t before = allocations();
+		auto start = std::chrono::steady_clock::now();
+		fn(iterations);
+		auto end = std::chrono::steady_clock::now();
+		allocs = allocations() - before;
+		return std::chrono::duration<double>(end - start).count();
+	}
+
+	std::vector<BenchResult> list;
+	unsigned int failed = 0;
+};
+
+/** Time the simulator's hot paths one at a time. */
+void microBenchmarks(BenchSuite& suite);
+
+/**
+ * Build a Kademlia network of each of the given sizes, warm it up,
+ * then time ticks of it with lookups going on.
+ */
+void macroBenchmarks(BenchSuite& suite, const std::vector<unsigned long>& sizes,
+                     Time warmup, Time ticks, unsigned int threads);
+
+}
+
+#endif
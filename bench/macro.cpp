@@ -0,0 +1,83 @@
+#include "bench/bench.hpp"
+
+#include "network.hpp"
+#include "log.hpp"
+#include "random.h"
+#include "kademlia/kademlia.hpp"
+
+#include <memory>
+#include <vector>
+
+using namespace dhtsim;
+
+/*
+ * Each network is built the way the simulator builds one: every node
+ * pings node zero to join, then the network runs warmup epochs
+ * untimed. In each timed epoch, one node in a hundred starts a lookup
+ * for a random key, so the load grows with the network.
+ */
+void dhtsim::macroBenchmarks(BenchSuite& suite, const std::vector<unsigned long>& sizes,
+                             Time warmup, Time ticks, unsigned int threads) {
+	// Nobody reads what the nodes log.
+	std::ostream null(nullptr);
+	event_stream = &null;
+	log_stream = &null;
+
+	for (unsigned long n : sizes) {
+		std::string name = "macro.nodes_" + std::to_string(n);
+		if (!suite.wanted(name)) continue;
+
+		global_rng = Random::Generator(1234);
+		CentralizedNetwork<uint32_t> net(1 << 16, threads);
+		KademliaNode::Config config;
+		std::vector<std::shared_ptr<KademliaNode>> nodes;
+		for (unsigned long i = 0; i < n; i++) {
+			auto node = std::make_shared<KademliaNode>(config);
+			net.add(node);
+			if (i > 0) {
+				node->ping(nodes[0]->getAddress(), KademliaNode::PingCallbackSet());
+			}
+			nodes.push_back(node);
+		}
+		for (Time t = 0; t < warmup; t++) {
+			net.tick();
+		}
+
+		// The ticks are timed in repeats stretches and the fastest
+		// one counts, like the best of repeats calls for the
+		// microbenchmarks. The lookups are the same every run, so
+		// the same stretch wins unless something got in the way.
+		Time stretch = std::max<Time>(1, ticks / std::max(1u, suite.repeats));
+		double bestTicks = 0, bestMessages = 0;
+		auto messages = net.messagesSent();
+		auto start = std::chrono::steady_clock::now();
+		Time stretchStart = 0;
+		for (Time t = 0; t < ticks; t++) {
+			for (unsigned long i = 0; i < std::max(1ul, n / 100); i++) {
+				KademliaNode::Key target;
+				for (auto& byte : target.key) {
+					byte = global_rng.Uint_32(0, 255);
+				}
+				auto& node = nodes[global_rng.Size_T(0, n - 1)];
+				node->findNodes(target, KademliaNode::FindNodesCallbackSet());
+			}
+			net.tick();
+
+			if (t + 1 - stretchStart == stretch || t + 1 == ticks) {
+				auto now = std::chrono::steady_clock::now();
+				double seconds = std::chrono::duration<double>(now - start).count();
+				bestTicks = std::max(bestTicks, (t + 1 - stretchStart) / seconds);
+				bestMessages = std::max(bestMessages, (net.messagesSent() - messages) / seconds);
+				messages = net.messagesSent();
+				start = now;
+				stretchStart = t + 1;
+			}
+		}
+
+		suite.report(name + ".ticks_per_sec", bestTicks, "ticks/s", true);
+		suite.report(name + ".msgs_per_sec", bestMessages, "msgs/s", true);
+	}
+
+	event_stream = nullptr;
+	log_stream = nullptr;
+}
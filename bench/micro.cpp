@@ -0,0 +1,471 @@
+#include "bench/bench.hpp"
+
+#include "base.hpp"
+#include "callback.hpp"
+#include "message.hpp"
+#include "random.h"
+#include "kademlia/kademlia.hpp"
+#include "kademlia/key_map.hpp"
+#include "kademlia/key_set.hpp"
+#include "kademlia/message_structs.hpp"
+
+#include <memory>
+#include <unordered_set>
+#include <vector>
+
+namespace dhtsim {
+
+/** Reaches into KademliaNode for the benchmarks below. */
+struct KademliaBench {
+	/**
+	 * Fill node's routing table with whichever of the given
+	 * entries fit, as if it had seen all of them.
+	 */
+	static void fill(KademliaNode& node, const std::vector<BucketEntry>& entries) {
+		for (const auto& entry : entries) {
+			unsigned int b = node.getKey().commonPrefixLength(entry.key);
+			if (b < KademliaNode::KEY_LEN_BITS) node.buckets.add(b, entry);
+		}
+	}
+	static std::vector<BucketEntry> getNearest(KademliaNode& node, unsigned n,
+	                                           const KademliaKey& target) {
+		return node.getNearest(n, target);
+	}
+	static void updateOrAddToBucket(KademliaNode& node, const BucketEntry& entry) {
+		node.updateOrAddToBucket(node.getKey().commonPrefixLength(entry.key), entry);
+	}
+	static void unobserve(KademliaNode& node, uint32_t address) {
+		node.unobserve(address);
+	}
+	/** The callbacks a ping sends with. */
+	static KademliaNode::SendCallbackSet pingCallback(KademliaNode& node, uint32_t address) {
+		return node.pingCallback(address);
+	}
+	/** The callbacks each query of a lookup sends with. */
+	static KademliaNode::SendCallbackSet queryCallback(KademliaNode& node,
+	                                                  const KademliaKey& target,
+	                                                  const BucketEntry& top) {
+		return node.findNodesQueryCallback(target, top);
+	}
+	/**
+	 * Hand node the answer to a request it sent, as far as the
+	 * callbacks waiting for it are concerned.
+	 */
+	static void answer(KademliaNode& node, const Message<uint32_t>& m) {
+		node.BaseApplication<uint32_t>::handleMessage(m);
+	}
+	/** The entries node knows of, in no particular order. */
+	static std::vector<BucketEntry> known(KademliaNode& node) {
+		std::vector<BucketEntry> entries;
+		for (unsigned int b = 0; b < KademliaNode::KEY_LEN_BITS; b++) {
+			for (const auto& entry : node.buckets.bucket(b)) {
+				entries.push_back(entry);
+			}
+		}
+		return entries;
+	}
+};
+
+}
+
+using namespace dhtsim;
+
+static KademliaKey randomKey(Random::Generator& rng) {
+	KademliaKey key;
+	for (auto& byte : key.key) {
+		byte = rng.Uint_32(0, 255);
+	}
+	return key;
+}
+
+static std::vector<BucketEntry> randomEntries(Random::Generator& rng, size_t n) {
+	std::vector<BucketEntry> entries(n);
+	for (size_t i = 0; i < n; i++) {
+		entries[i].key = randomKey(rng);
+		entries[i].address = i + 1;
+		entries[i].lastSeen = 0;
+	}
+	return entries;
+}
+
+/** Time writing msg into a message and reading it back out. */
+template <typename T>
+static void messageBenchmarks(BenchSuite& suite, const std::string& name, const T& msg) {
+	suite.measure("message.write." + name, [&msg](uint64_t iterations) {
+		Message<uint32_t> m;
+		for (uint64_t i = 0; i < iterations; i++) {
+			writeToMessage(msg, m);
+			keep(m);
+		}
+	});
+
+	Message<uint32_t> m;
+	writeToMessage(msg, m);
+	suite.measure("message.read." + name, [&m](uint64_t iterations) {
+		for (uint64_t i = 0; i < iterations; i++) {
+			T read;
+			readFromMessage(read, m);
+			keep(read);
+		}
+	});
+}
+
+static void messageBenchmarks(BenchSuite& suite, Random::Generator& rng) {
+	PingMessage ping = PingMessage::ping();
+	ping.sender = randomKey(rng);
+	messageBenchmarks(suite, "ping", ping);
+
+	FindNodesMessage request;
+	request.sender = randomKey(rng);
+	request.request = true;
+	request.target = randomKey(rng);
+	request.num_found = 0;
+	messageBenchmarks(suite, "find_nodes_request", request);
+
+	// A full answer, with k = 20 nodes.
+	FindNodesMessage response = request;
+	response.request = false;
+	response.nearest = randomEntries(rng, 20);
+	response.num_found = response.nearest.size();
+	messageBenchmarks(suite, "find_nodes_response", response);
+
+	FindNodesMessage value = request;
+	value.request = false;
+	value.find_value = true;
+	value.value_found = true;
+	value.value.assign(64, 'v');
+	messageBenchmarks(suite, "find_value_response", value);
+
+	StoreMessage store;
+	store.request = true;
+	store.sender = randomKey(rng);
+	store.value.assign(64, 'v');
+	messageBenchmarks(suite, "store", store);
+}
+
+/*
+ * The byte-at-a-time distance operations that KademliaKey's
+ * word-at-a-time ones replaced, kept to measure them against.
+ */
+namespace bytewise {
+
+/** How many trailing zeros does c have in binary? */
+static unsigned l2c(unsigned char c) {
+	unsigned result = 0;
+	for ( ; c > 0; c >>= 1, result++);
+	return result;
+}
+
+static unsigned commonPrefixLength(const KademliaKey& k1, const KademliaKey& k2) {
+	unsigned i;
+	for (i = 0; i < KADEMLIA_KEY_LEN; i++) {
+		unsigned char cmp = k1.key[i] ^ k2.key[i];
+		if (cmp != 0) {
+			return (i + 1) * 8 - l2c(cmp);
+		}
+	}
+	return KADEMLIA_KEY_LEN * 8;
+}
+
+static bool closer(const KademliaKey& target, const KademliaKey& k1, const KademliaKey& k2) {
+	unsigned i;
+	for (i = 0; i < KADEMLIA_KEY_LEN; i++) {
+		unsigned char k1t = k1.key[i] ^ target.key[i];
+		unsigned char k2t = k2.key[i] ^ target.key[i];
+		if (k1t != k2t) {
+			return k1t < k2t;
+		}
+	}
+	return false;
+}
+
+}
+
+/**
+ * Prefix lengths and distance comparisons, byte-wise and word-wise,
+ * on random keys and on keys that share 8 to 16 leading bytes, as
+ * the ones a lookup compares near its end do.
+ */
+static void keyBenchmarks(BenchSuite& suite, Random::Generator& rng) {
+	const size_t KEYS = 1024;
+	std::vector<KademliaKey> random, shared;
+	KademliaKey prefix = randomKey(rng);
+	for (size_t i = 0; i < KEYS; i++) {
+		random.push_back(randomKey(rng));
+		KademliaKey key = randomKey(rng);
+		memcpy(key.key, prefix.key, 8 + i % 9);
+		shared.push_back(key);
+	}
+
+	bool same = true;
+	for (const auto* keys : {&random, &shared}) {
+		for (size_t i = 0; i < KEYS; i++) {
+			const auto& a = (*keys)[i];
+			const auto& b = (*keys)[(i + 1) % KEYS];
+			const auto& c = (*keys)[(i + 2) % KEYS];
+			same = same && a.commonPrefixLength(b) == bytewise::commonPrefixLength(a, b)
+				&& a.closer(b, c) == bytewise::closer(a, b, c)
+				&& a.closer(c, b) == bytewise::closer(a, c, b);
+		}
+	}
+	suite.expect("key.wordwise_matches_bytewise", same, same ? "same" : "different");
+
+	for (const auto& set : {std::make_pair("random", &random), std::make_pair("shared_prefix", &shared)}) {
+		const auto& keys = *set.second;
+		std::string suffix = std::string(".") + set.first;
+		suite.measure("key.commonPrefixLength.bytewise" + suffix, [&keys](uint64_t iterations) {
+			unsigned int total = 0;
+			for (uint64_t i = 0; i < iterations; i++) {
+				total += bytewise::commonPrefixLength(keys[i % KEYS], keys[(i + 1) % KEYS]);
+			}
+			keep(total);
+		});
+		suite.measure("key.commonPrefixLength.wordwise" + suffix, [&keys](uint64_t iterations) {
+			unsigned int total = 0;
+			for (uint64_t i = 0; i < iterations; i++) {
+				total += keys[i % KEYS].commonPrefixLength(keys[(i + 1) % KEYS]);
+			}
+			keep(total);
+		});
+		suite.measure("key.closer.bytewise" + suffix, [&keys](uint64_t iterations) {
+			unsigned int total = 0;
+			for (uint64_t i = 0; i < iterations; i++) {
+				total += bytewise::closer(keys[i % KEYS], keys[(i + 1) % KEYS],
+				                          keys[(i + 2) % KEYS]);
+			}
+			keep(total);
+		});
+		suite.measure("key.closer.wordwise" + suffix, [&keys](uint64_t iterations) {
+			unsigned int total = 0;
+			for (uint64_t i = 0; i < iterations; i++) {
+				total += keys[i % KEYS].closer(keys[(i + 1) % KEYS], keys[(i + 2) % KEYS]);
+			}
+			keep(total);
+		});
+	}
+}
+
+static void kademliaBenchmarks(BenchSuite& suite, Random::Generator& rng) {
+	const size_t TARGETS = 1024;
+	std::vector<KademliaKey> targets;
+	for (size_t i = 0; i < TARGETS; i++) {
+		targets.push_back(randomKey(rng));
+	}
+
+	// About what a node in a network of ten thousand knows.
+	KademliaNode::Config config;
+	KademliaNode node(config);
+	KademliaBench::fill(node, randomEntries(rng, 10000));
+	auto known = KademliaBench::known(node);
+
+	suite.measure("kademlia.getNearest", [&](uint64_t iterations) {
+		for (uint64_t i = 0; i < iterations; i++) {
+			auto nearest = KademliaBench::getNearest(node, config.k, targets[i % TARGETS]);
+			keep(nearest);
+		}
+	});
+
+	// Seeing a node that's already in the table: the common case.
+	suite.measure("kademlia.updateOrAddToBucket.known", [&](uint64_t iterations) {
+		for (uint64_t i = 0; i < iterations; i++) {
+			KademliaBench::updateOrAddToBucket(node, known[i % known.size()]);
+		}
+	});
+
+	// Seeing a new node where there's room for it, and losing it
+	// again so the table stays the same. Random keys would nearly
+	// all land in the few full buckets, so these share the first
+	// b bits with the node's key.
+	std::vector<BucketEntry> fresh = randomEntries(rng, TARGETS);
+	for (size_t i = 0; i < fresh.size(); i++) {
+		unsigned int b = 16 + i % 64;
+		auto& key = fresh[i].key.key;
+		for (unsigned int j = 0; j < b / 8 + 1; j++) {
+			key[j] = node.getKey().key[j];
+		}
+		key[b / 8] ^= 0x80 >> (b % 8);
+		fresh[i].address += 1 << 20;
+	}
+	suite.measure("kademlia.updateOrAddToBucket.new", [&](uint64_t iterations) {
+		for (uint64_t i = 0; i < iterations; i++) {
+			const auto& entry = fresh[i % fresh.size()];
+			KademliaBench::updateOrAddToBucket(node, entry);
+			KademliaBench::unobserve(node, entry.address);
+		}
+	});
+}
+
+/**
+ * The key tables with keys that share all but their last 8 bytes, the
+ * way keys a node stores near its own ID share a long prefix. With a
+ * poor hash they all want the same slot and every probe walks them
+ * all.
+ */
+static void keyTableBenchmarks(BenchSuite& suite, Random::Generator& rng) {
+	const size_t KEYS = 4096;
+	KademliaKey prefix = randomKey(rng);
+	std::vector<KademliaKey> keys;
+	for (size_t i = 0; i < KEYS; i++) {
+		KademliaKey key = randomKey(rng);
+		memcpy(key.key, prefix.key, KADEMLIA_KEY_LEN - 8);
+		keys.push_back(key);
+	}
+
+	// Random slots would leave about 80% of the keys with a slot to
+	// themselves in a table twice their size.
+	std::unordered_set<size_t> slots;
+	for (const auto& key : keys) {
+		slots.insert(key.hash() & (2 * KEYS - 1));
+	}
+	suite.expect("key.hash.shared_prefix", slots.size() > KEYS / 2,
+	             std::to_string(slots.size()) + "/" + std::to_string(KEYS) + " slots");
+
+	suite.measure("keyset.insert.shared_prefix", [&keys](uint64_t iterations) {
+		KeySet set;
+		for (uint64_t i = 0; i < iterations; i++) {
+			if (i % KEYS == 0) set = KeySet();
+			keep(set.insert(keys[i % KEYS]));
+		}
+	});
+
+	KeyMap<uint64_t> map;
+	for (size_t i = 0; i < KEYS; i++) {
+		map.insert(keys[i], i);
+	}
+	suite.measure("keymap.find.shared_prefix", [&keys, &map](uint64_t iterations) {
+		uint64_t total = 0;
+		for (uint64_t i = 0; i < iterations; i++) {
+			total += *map.find(keys[i % KEYS]);
+		}
+		keep(total);
+	});
+}
+
+static void callbackBenchmarks(BenchSuite& suite) {
+	using SendCallbackSet = BaseApplication<uint32_t>::SendCallbackSet;
+	unsigned long calls = 0;
+
+	// The size of capture most callbacks in the simulator have.
+	suite.measure("callback.construct", [&calls](uint64_t iterations) {
+		for (uint64_t i = 0; i < iterations; i++) {
+			SendCallbackSet cb([&calls, i](Message<uint32_t>) { calls += i; },
+			                   [&calls, i](Message<uint32_t>) { calls -= i; });
+			keep(cb);
+		}
+	});
+
+	suite.measure("callback.merge", [&calls](uint64_t iterations) {
+		for (uint64_t i = 0; i < iterations; i++) {
+			SendCallbackSet cb([&calls, i](Message<uint32_t>) { calls += i; },
+			                   [&calls, i](Message<uint32_t>) { calls -= i; });
+			cb += SendCallbackSet([&calls](Message<uint32_t>) { calls++; },
+			                      [&calls](Message<uint32_t>) { calls--; });
+			keep(cb);
+		}
+	});
+	keep(calls);
+}
+
+/**
+ * Time a tick of an application with nothing to do but a lot of
+ * requests waiting for responses, which shouldn't cost more than
+ * one with none.
+ */
+static void tickBenchmarks(BenchSuite& suite) {
+	using App = BaseApplication<uint32_t>;
+	for (unsigned long outstanding : {0ul, 100ul, 10000ul}) {
+		App app;
+		for (unsigned long i = 0; i < outstanding; i++) {
+			app.send(Message<uint32_t>(0, 0, 1, 0),
+			         App::SendCallbackSet([](Message<uint32_t>) {}, [](Message<uint32_t>) {}),
+			         1, 1ul << 40);
+		}
+		while (app.unqueueOut()) {}
+
+		Time time = 0;
+		suite.measure("base.tick.outstanding_" + std::to_string(outstanding),
+		              [&app, &time](uint64_t iterations) {
+			for (uint64_t i = 0; i < iterations; i++) {
+				app.tick(++time);
+			}
+		});
+	}
+}
+
+/**
+ * The allocations made by a round of RPCs from a node that has
+ * already done the same round once: every message is sent with the
+ * callbacks that callbacks(node, i) builds, taken off the outqueue,
+ * and answered. Payloads come from a pool, and the outqueue and the
+ * records of pending responses keep their memory, so a warmed up
+ * node has nothing left to allocate but what the callbacks do.
+ */
+template <typename Callbacks>
+static uint64_t rpcAllocations(const std::vector<Message<uint32_t>>& messages,
+                               Callbacks callbacks) {
+	KademliaNode::Config config;
+	KademliaNode node(config);
+	uint64_t allocs = 0;
+	for (int round = 0; round < 2; round++) {
+		uint64_t before = allocations();
+		for (size_t i = 0; i < messages.size(); i++) {
+			node.send(messages[i], callbacks(node, i), 1, 2);
+		}
+		while (auto out = node.unqueueOut()) {
+			KademliaBench::answer(node, *out);
+		}
+		allocs = allocations() - before;
+	}
+	return allocs;
+}
+
+/**
+ * Check that a ping or a lookup query, with the callbacks the node
+ * really sends them with, makes no heap allocations at all once the
+ * node is warmed up. A callback that outgrew InlineFunction would go
+ * to the heap and fail it, and so would the RPC machinery if it
+ * stopped reusing its memory.
+ */
+static void allocationChecks(BenchSuite& suite, Random::Generator& rng) {
+	const size_t SENDS = 1000;
+	std::vector<BucketEntry> tops = randomEntries(rng, SENDS);
+	KademliaKey target = randomKey(rng);
+	std::vector<Message<uint32_t>> messages;
+	for (size_t i = 0; i < SENDS; i++) {
+		Message<uint32_t> m(KademliaNode::KM_PING, 1, tops[i].address, 0);
+		writeToMessage(PingMessage::ping(), m);
+		messages.push_back(m);
+	}
+
+	suite.expectNoAllocations("alloc.ping", rpcAllocations(messages,
+		[&tops](KademliaNode& node, size_t i) {
+			return KademliaBench::pingCallback(node, tops[i].address);
+		}));
+	suite.expectNoAllocations("alloc.find_nodes", rpcAllocations(messages,
+		[&tops, &target](KademliaNode& node, size_t i) {
+			return KademliaBench::queryCallback(node, target, tops[i]);
+		}));
+
+	// What callers hand to findNodes, merged into a lookup that's
+	// already under way, as a bucket refresh or a fetch does.
+	auto shared = std::make_shared<unsigned long>(0);
+	uint64_t before = allocations();
+	for (size_t i = 0; i < SENDS; i++) {
+		auto fn = [shared](FindNodesMessage) { (*shared)++; };
+		KademliaNode::FindNodesCallbackSet lookup;
+		lookup += KademliaNode::FindNodesCallbackSet(fn, fn);
+		keep(lookup);
+	}
+	suite.expectNoAllocations("alloc.lookup_callbacks", allocations() - before);
+}
+
+void dhtsim::microBenchmarks(BenchSuite& suite) {
+	Random::Generator rng(1234);
+	messageBenchmarks(suite, rng);
+	keyBenchmarks(suite, rng);
+	kademliaBenchmarks(suite, rng);
+	keyTableBenchmarks(suite, rng);
+	callbackBenchmarks(suite);
+	tickBenchmarks(suite);
+	allocationChecks(suite, rng);
+}
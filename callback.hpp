@@ -1,69 +1,101 @@
 #ifndef DHTSIM_CALLBACK_H
 #define DHTSIM_CALLBACK_H
 
-#include <functional>
+#include "inline_function.hpp"
+
+#include <vector>
+#include <utility>
+
 namespace dhtsim {
 
+/**
+ * A set of functions to call when something succeeds or fails.
+ *
+ * The common case is one function for each outcome; those are stored
+ * inline, so creating one doesn't allocate. Merging more callbacks in
+ * with += spills the extras into vectors. Callback sets are move-only:
+ * whoever owns one is the only one who can fire it.
+ */
 template <typename SuccessParameter,
 	  typename FailureParameter = SuccessParameter>
 class CallbackSet {
 public:
-	using SuccessFn = std::function<void(SuccessParameter)>;
-	using FailureFn = std::function<void(FailureParameter)>;
+	using SuccessFn = InlineFunction<void(SuccessParameter)>;
+	using FailureFn = InlineFunction<void(FailureParameter)>;
 	// Main constructors
-        CallbackSet() : successFns({}), failureFns({}) {}
-        CallbackSet(const std::vector<SuccessFn>& successFns,
-			const std::vector<FailureFn>& failureFns)
-		: successFns(successFns),
-		  failureFns(failureFns) {};
-	CallbackSet(const SuccessFn& successFn,
-		    const FailureFn& failureFn) {
-		this->successFns.push_back(successFn);
-		this->failureFns.push_back(failureFn);
-	}
+        CallbackSet() = default;
+	CallbackSet(SuccessFn successFn, FailureFn failureFn)
+		: successFn(std::move(successFn)),
+		  failureFn(std::move(failureFn)) {}
+
+	CallbackSet(CallbackSet&&) = default;
+	CallbackSet& operator=(CallbackSet&&) = default;
+	CallbackSet(const CallbackSet&) = delete;
+	CallbackSet& operator=(const CallbackSet&) = delete;
 
 	// Static constructors
 	static CallbackSet onSuccess(SuccessFn fn) {
-		CallbackSet s;
-		s.successFns.push_back(fn);
-		return s;
+		return CallbackSet(std::move(fn), FailureFn());
 	}
 	static CallbackSet onFailure(FailureFn fn) {
-		CallbackSet s;
-		s.failureFns.push_back(fn);
-		return s;
+		return CallbackSet(SuccessFn(), std::move(fn));
 	}
 
 	void success(SuccessParameter m) const {
-		for (const auto& sf : this->successFns) {
+		if (this->successFn) this->successFn(m);
+		for (const auto& sf : this->moreSuccessFns) {
 			sf(m);
 		}
 	}
 	void failure(FailureParameter m) const {
-		for (const auto& ff : this->failureFns) {
+		if (this->failureFn) this->failureFn(m);
+		for (const auto& ff : this->moreFailureFns) {
 			ff(m);
 		}
 	}
 
 	bool empty() const {
-		return this->successFns.empty() && this->failureFns.empty();
+		return !this->successFn && !this->failureFn;
 	}
 
-	void operator+=(const CallbackSet& other) {
-		this->successFns.insert(this->successFns.end(),
-					other.successFns.begin(), other.successFns.end());
-		this->failureFns.insert(this->failureFns.end(),
-					other.failureFns.begin(), other.failureFns.end());
+	/**
+	 * Take over the other set's functions. Filling an empty slot
+	 * is just a move; only actual extras end up in the vectors.
+	 */
+	void operator+=(CallbackSet&& other) {
+		merge(this->successFn, this->moreSuccessFns,
+		      other.successFn, other.moreSuccessFns);
+		merge(this->failureFn, this->moreFailureFns,
+		      other.failureFn, other.moreFailureFns);
 	}
-	friend CallbackSet operator+(const CallbackSet& c1, const CallbackSet& c2) {
-		CallbackSet result;
-		result += c1;
-		result += c2;
+	friend CallbackSet operator+(CallbackSet&& c1, CallbackSet&& c2) {
+		CallbackSet result(std::move(c1));
+		result += std::move(c2);
 		return result;
 	}
 private:
-	std::vector<SuccessFn> successFns;
-	std::vector<FailureFn> failureFns;
+	template <typename Fn>
+	static void merge(Fn& first, std::vector<Fn>& more,
+	                  Fn& otherFirst, std::vector<Fn>& otherMore) {
+		if (otherFirst) {
+			if (!first) {
+				first = std::move(otherFirst);
+			} else {
+				more.push_back(std::move(otherFirst));
+			}
+		}
+		for (auto& fn : otherMore) {
+			more.push_back(std::move(fn));
+		}
+		otherMore.clear();
+	}
+
+	/* Invariant: the vectors are only non-empty if the inline
+	 * function before them is set. */
+	SuccessFn successFn;
+	FailureFn failureFn;
+	std::vector<SuccessFn> moreSuccessFns;
+	std::vector<FailureFn> moreFailureFns;
 };
 }
 
@@ -0,0 +1,100 @@
+#ifndef DHTSIM_DELAY_LINE_H
+#define DHTSIM_DELAY_LINE_H
+
+#include "time.hpp"
+
+#include <vector>
+#include <utility>
+
+namespace dhtsim {
+
+/**
+ * Holds values until the time they're due, like a calendar queue
+ * with one bucket per epoch. The buckets form a ring that is always
+ * longer than the longest delay in it, so each bucket holds exactly
+ * one epoch's values: adding a value and releasing it later are both
+ * O(1), whatever the number of values in flight. If a value comes in
+ * that is further away than the ring is long, the ring doubles.
+ *
+ * Values due at the same time come out in the order they went in.
+ */
+template <typename T> class DelayLine {
+public:
+	DelayLine() : current(0), count(0), buckets(INITIAL_SIZE) {}
+
+	/** Hold value until time. Times in the past mean "now". */
+	void push(Time time, T value) {
+		if (time < this->current) time = this->current;
+		while (time - this->current >= this->buckets.size()) {
+			this->grow();
+		}
+		this->buckets[time & this->mask()].push_back(std::move(value));
+		this->count++;
+	}
+
+	/**
+	 * Call fn on every value due up to and including time, in time
+	 * order. fn must not push anything.
+	 */
+	template <typename Fn> void release(Time time, Fn fn) {
+		for (; this->current <= time; this->current++) {
+			if (this->count == 0) {
+				this->current = time + 1;
+				break;
+			}
+			auto& bucket = this->buckets[this->current & this->mask()];
+			for (auto& value : bucket) {
+				fn(value);
+			}
+			this->count -= bucket.size();
+			// Clearing keeps the bucket's capacity for next time
+			// around the ring.
+			bucket.clear();
+		}
+	}
+
+	/** Call fn(time, value) on everything held, in time order. */
+	template <typename Fn> void forEach(Fn fn) const {
+		Time time = this->current;
+		for (size_t seen = 0; seen < this->count; time++) {
+			for (const auto& value : this->buckets[time & this->mask()]) {
+				fn(time, value);
+				seen++;
+			}
+		}
+	}
+
+	/** Start from the given time instead of 0. Only for an empty line. */
+	void skipTo(Time time) {
+		if (this->count == 0) this->current = time;
+	}
+
+	size_t size() const { return this->count; }
+	bool empty() const { return this->count == 0; }
+
+private:
+	static const size_t INITIAL_SIZE = 64;
+
+	size_t mask() const { return this->buckets.size() - 1; }
+
+	void grow() {
+		std::vector<std::vector<T>> old;
+		std::swap(old, this->buckets);
+		this->buckets.resize(old.size() * 2);
+		// Each old bucket holds a single time in
+		// [current, current + old size).
+		for (size_t i = 0; i < old.size(); i++) {
+			Time time = this->current + i;
+			std::swap(this->buckets[time & this->mask()], old[time & (old.size() - 1)]);
+		}
+	}
+
+	/** Nothing before this is left. */
+	Time current;
+	size_t count;
+	std::vector<std::vector<T>> buckets;
+};
+
+}
+
+#endif
@@ -0,0 +1,202 @@
+#include "event_log.hpp"
+#include "log.hpp"
+
+#include <cstring>
+
+using namespace dhtsim;
+
+int EventRecord::fieldCount(uint8_t type) {
+	switch (type) {
+	case EV_TICK: return 2;
+	case EV_SUCCESS: return 3;
+	case EV_FAILURE: return 3;
+	case EV_REPLACE: return 1;
+	case EV_DROP: return 2;
+	case EV_RETRY: return 2;
+	case EV_LOOKUP: return 5;
+	default: return -1;
+	}
+}
+
+void EventRecord::encode(std::vector<unsigned char>& out) const {
+	out.push_back(this->type);
+	int count = this->fieldCount();
+	for (int i = 0; i < count; i++) {
+		uint64_t value = this->fields[i];
+		while (value >= 0x80) {
+			out.push_back((value & 0x7f) | 0x80);
+			value >>= 7;
+		}
+		out.push_back(value);
+	}
+}
+
+void EventRecord::writeText(std::ostream& os) const {
+	os << "[E] " << (char) this->type;
+	int count = this->fieldCount();
+	for (int i = 0; i < count; i++) {
+		os << " " << this->fields[i];
+	}
+	os << "\n";
+}
+
+void dhtsim::logEvent(const EventRecord& event) {
+	if (!EventLog::global().isOpen()) {
+		event.writeText(eventStream());
+	} else if (event_buffer) {
+		event.encode(*event_buffer);
+	} else {
+		EventLog::global().write(event);
+	}
+}
+
+bool EventLog::open(const std::string& path) {
+	this->close();
+	this->file = std::fopen(path.c_str(), "wb");
+	if (this->file == nullptr) {
+		return false;
+	}
+	std::fwrite(MAGIC, 1, MAGIC_LEN, this->file);
+	this->stopping = false;
+	this->current.reserve(BUFFER_SIZE);
+	this->writer = std::thread([this]() { this->writerLoop(); });
+	return true;
+}
+
+void EventLog::close() {
+	if (this->file == nullptr) return;
+
+	this->submit();
+	{
+		std::lock_guard<std::mutex> guard(this->lock);
+		this->stopping = true;
+	}
+	this->queued.notify_one();
+	this->writer.join();
+
+	std::fclose(this->file);
+	this->file = nullptr;
+	this->spare.clear();
+}
+
+void EventLog::write(const EventRecord& event) {
+	event.encode(this->current);
+	if (this->current.size() >= BUFFER_SIZE) {
+		this->submit();
+	}
+}
+
+void EventLog::append(const std::vector<unsigned char>& records) {
+	this->current.insert(this->current.end(), records.begin(), records.end());
+	if (this->current.size() >= BUFFER_SIZE) {
+		this->submit();
+	}
+}
+
+/** Hand the current buffer to the writer and start a new one. */
+void EventLog::submit() {
+	if (this->current.empty()) return;
+
+	std::vector<unsigned char> next;
+	{
+		std::unique_lock<std::mutex> guard(this->lock);
+		this->written.wait(guard, [this]() { return this->full.size() < MAX_QUEUED; });
+		this->full.push_back(std::move(this->current));
+		if (!this->spare.empty()) {
+			next = std::move(this->spare.back());
+			this->spare.pop_back();
+		}
+	}
+	this->queued.notify_one();
+
+	next.clear();
+	next.reserve(BUFFER_SIZE);
+	this->current = std::move(next);
+}
+
+void EventLog::writerLoop() {
+	std::unique_lock<std::mutex> guard(this->lock);
+	while (true) {
+		this->queued.wait(guard, [this]() { return this->stopping || !this->full.empty(); });
+		if (this->full.empty()) {
+			// Stopping, and everything has been written.
+			break;
+		}
+		auto buffer = std::move(this->full.front());
+		this->full.pop_front();
+
+		guard.unlock();
+		std::fwrite(buffer.data(), 1, buffer.size(), this->file);
+		guard.lock();
+
+		this->spare.push_back(std::move(buffer));
+		this->written.notify_one();
+	}
+	std::fflush(this->file);
+}
+
+EventReader::~EventReader() {
+	if (this->file) {
+		std::fclose(this->file);
+	}
+}
+
+bool EventReader::open(const std::string& path) {
+	this->file = std::fopen(path.c_str(), "rb");
+	if (this->file == nullptr) {
+		return false;
+	}
+	char magic[EventLog::MAGIC_LEN];
+	if (std::fread(magic, 1, sizeof(magic), this->file) != sizeof(magic)
+	    || std::memcmp(magic, EventLog::MAGIC, sizeof(magic)) != 0) {
+		this->bad = true;
+		return false;
+	}
+	return true;
+}
+
+bool EventReader::readByte(unsigned char& c) {
+	if (this->pos == this->buffer.size()) {
+		this->buffer.resize(1 << 20);
+		size_t got = std::fread(this->buffer.data(), 1, this->buffer.size(), this->file);
+		this->buffer.resize(got);
+		this->pos = 0;
+		if (got == 0) return false;
+	}
+	c = this->buffer[this->pos++];
+	return true;
+}
+
+bool EventReader::readVarint(uint64_t& value) {
+	value = 0;
+	for (unsigned int shift = 0; shift < 64; shift += 7) {
+		unsigned char c;
+		if (!this->readByte(c)) return false;
+		value |= uint64_t(c & 0x7f) << shift;
+		if (!(c & 0x80)) return true;
+	}
+	return false;
+}
+
+bool EventReader::next(EventRecord& event) {
+	if (this->file == nullptr || this->bad) return false;
+
+	unsigned char type;
+	if (!this->readByte(type)) {
+		// A clean end of file.
+		return false;
+	}
+	int count = EventRecord::fieldCount(type);
+	if (count < 0) {
+		this->bad = true;
+		return false;
+	}
+	event = EventRecord{(EventType) type, {}};
+	for (int i = 0; i < count; i++) {
+		if (!this->readVarint(event.fields[i])) {
+			this->bad = true;
+			return false;
+		}
+	}
+	return true;
+}
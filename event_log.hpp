@@ -0,0 +1,162 @@
+#ifndef DHTSIM_EVENT_LOG_H
+#define DHTSIM_EVENT_LOG_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <iostream>
+
+namespace dhtsim {
+
+/**
+ * The kinds of things that go in the event log. The codes are the
+ * letters the text format uses after "[E]".
+ */
+enum EventType : uint8_t {
+	EV_TICK = 'T',    // epoch, bytes transferred during it
+	EV_SUCCESS = 'S', // node index, data index, epochs taken
+	EV_FAILURE = 'F', // node index, data index, epochs taken
+	EV_REPLACE = 'R', // node index
+	EV_DROP = 'D',    // address, message size
+	EV_RETRY = 'Y',   // address, message size
+	EV_LOOKUP = 'L',  // address, queries, max in flight, epochs, skipped
+};
+
+/** One record in the event log: a type and a few numbers. */
+struct EventRecord {
+	static const unsigned int MAX_FIELDS = 5;
+
+	EventType type;
+	uint64_t fields[MAX_FIELDS] = {};
+
+	/** How many fields a type has, or -1 for an unknown type. */
+	static int fieldCount(uint8_t type);
+	int fieldCount() const { return fieldCount(this->type); }
+
+	static EventRecord tick(uint64_t epoch, uint64_t bytes) {
+		return {EV_TICK, {epoch, bytes}};
+	}
+	static EventRecord success(uint64_t node, uint64_t data, uint64_t epochs) {
+		return {EV_SUCCESS, {node, data, epochs}};
+	}
+	static EventRecord failure(uint64_t node, uint64_t data, uint64_t epochs) {
+		return {EV_FAILURE, {node, data, epochs}};
+	}
+	static EventRecord replace(uint64_t node) {
+		return {EV_REPLACE, {node}};
+	}
+	static EventRecord drop(uint64_t address, uint64_t size) {
+		return {EV_DROP, {address, size}};
+	}
+	static EventRecord retry(uint64_t address, uint64_t size) {
+		return {EV_RETRY, {address, size}};
+	}
+	static EventRecord lookup(uint64_t address, uint64_t queries, uint64_t maxInFlight,
+	                          uint64_t epochs, uint64_t skipped) {
+		return {EV_LOOKUP, {address, queries, maxInFlight, epochs, skipped}};
+	}
+
+	/** Append the binary form of this event to out. */
+	void encode(std::vector<unsigned char>& out) const;
+	/** Write the "[E] ..." text form of this event, with a newline. */
+	void writeText(std::ostream& os) const;
+};
+
+/*
+ * Buffer for binary records made inside an application's tick. Like
+ * event_stream, the network points this at a per-shard buffer and
+ * appends the buffers to the log in order at the end of the epoch.
+ */
+inline thread_local std::vector<unsigned char>* event_buffer = nullptr;
+
+/**
+ * The binary event log. Records are a type byte followed by the
+ * event's fields as LEB128 varints, after an 8 byte file header.
+ *
+ * Records are collected in large buffers, and full buffers are
+ * written to the file by a background thread, so the simulation
+ * never waits on a write (unless the writer falls far behind).
+ */
+class EventLog {
+public:
+	static constexpr const char* MAGIC = "DHTEVT1\n";
+	static const size_t MAGIC_LEN = 8;
+
+	/** The log that logEvent writes to. */
+	static EventLog& global() {
+		static EventLog log;
+		return log;
+	}
+
+	~EventLog() { this->close(); }
+
+	/** Start writing to the given file. Returns false on failure. */
+	bool open(const std::string& path);
+	/** Write out everything buffered and close the file. */
+	void close();
+	bool isOpen() const { return this->file != nullptr; }
+
+	/** Add a record. Only call this from the main thread. */
+	void write(const EventRecord& event);
+	/** Add records encoded elsewhere. Only call this from the main thread. */
+	void append(const std::vector<unsigned char>& records);
+
+private:
+	static const size_t BUFFER_SIZE = 1 << 20;
+	/** How many full buffers can wait for the writer. */
+	static const size_t MAX_QUEUED = 16;
+
+	void submit();
+	void writerLoop();
+
+	std::FILE* file = nullptr;
+	std::thread writer;
+
+	std::mutex lock;
+	std::condition_variable queued, written;
+	std::deque<std::vector<unsigned char>> full;
+	std::vector<std::vector<unsigned char>> spare;
+	bool stopping = false;
+
+	/** The buffer being filled. */
+	std::vector<unsigned char> current;
+};
+
+/**
+ * Record an event. If a binary event log is open, it goes there.
+ * Otherwise it's written as a text line to eventStream().
+ */
+void logEvent(const EventRecord& event);
+
+/** Reads back the records written by EventLog. */
+class EventReader {
+public:
+	~EventReader();
+
+	/** Returns false if the file can't be read or isn't an event log. */
+	bool open(const std::string& path);
+
+	/** Read the next record. Returns false at the end of the log. */
+	bool next(EventRecord& event);
+
+	/** Did reading stop because of a bad or truncated record? */
+	bool failed() const { return this->bad; }
+
+private:
+	bool readByte(unsigned char& c);
+	bool readVarint(uint64_t& value);
+
+	std::FILE* file = nullptr;
+	std::vector<unsigned char> buffer;
+	size_t pos = 0;
+	bool bad = false;
+};
+
+}
+
+#endif
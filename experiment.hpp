@@ -3,8 +3,12 @@
 
 #include "network.hpp"
 #include "callback.hpp"
+#include "event_log.hpp"
+#include "snapshot.hpp"
+#include "metrics.hpp"
 
 #include <cstdint>
+#include <mutex>
 #include <iostream> //temporary
 
 
@@ -14,15 +18,63 @@ class Experiment {
 public:
 	using Key = typename Node::Key;
 	using FetchCallbackSet = CallbackSet<std::vector<unsigned char>, int>;
+	using Config = typename Node::Config;
 	// there is no way to do that through the generic DHTNode
 	// interface.
 	Experiment(CentralizedNetwork<uint32_t>& net,
-	           const std::vector<std::shared_ptr<Application<uint32_t>>>& nodes) :
-		net(net), nodes(nodes), waiting(nodes.size(), 0), current_epoch(0) {}
+	           const std::vector<std::shared_ptr<Application<uint32_t>>>& nodes,
+	           Config config) :
+		net(net), nodes(nodes), waiting(nodes.size(), 0), current_epoch(0),
+		config(config) {}
 
 	virtual void init() = 0;
 	virtual void run() = 0;
 
+	/**
+	 * Save the experiment's own state, after the network's. The
+	 * nodes are saved by address.
+	 */
+	void save(SnapshotWriter& out) {
+		std::vector<uint32_t> addresses;
+		for (const auto& node : this->nodes) {
+			addresses.push_back(node->getAddress());
+		}
+		out.pods(addresses);
+		out.pods(this->waiting);
+		out.pods(this->stored_data_keys);
+		out.pod(this->current_epoch);
+	}
+	/** How many epochs the successful fetches took. */
+	Histogram fetchLatencies() {
+		std::lock_guard<std::mutex> guard(this->statsLock);
+		return this->latencies;
+	}
+	/** How many fetches failed. */
+	uint64_t fetchFailures() {
+		std::lock_guard<std::mutex> guard(this->statsLock);
+		return this->failures;
+	}
+
+	/** Read back what save wrote, once the network is restored. */
+	bool restore(SnapshotReader& in) {
+		std::vector<uint32_t> addresses;
+		in.pods(addresses);
+		this->nodes.clear();
+		for (auto address : addresses) {
+			auto node = this->net.get(address);
+			if (!node) {
+				in.fail();
+				break;
+			}
+			this->nodes.push_back(node);
+		}
+		in.pods(this->waiting);
+		in.pods(this->stored_data_keys);
+		in.pod(this->current_epoch);
+		if (this->waiting.size() != this->nodes.size()) in.fail();
+		return !in.failed();
+	}
+
 protected:
 
 	void addNode(std::shared_ptr<Node> n) {
@@ -32,24 +84,39 @@ protected:
 	}
 
 
-	CentralizedNetwork<uint32_t> net;
+	CentralizedNetwork<uint32_t>& net;
 	std::vector<std::shared_ptr<Application<uint32_t>>> nodes;
-	// a bit mask over each node, "is this node waiting for something?"
-	std::vector<bool> waiting;
+	// a flag for each node, "is this node waiting for something?"
+	// (not a vector<bool>: nodes on different threads set their own
+	// flags at the same time.)
+	std::vector<char> waiting;
 
 	// the keys data for each node we stored
 	std::vector<Key> stored_data_keys;
 	unsigned int current_epoch;
 
+	/** The configuration of the nodes this experiment makes. */
+	Config config;
+
+	// Fetches finish inside ticks, which may be on several
+	// threads at once.
+	std::mutex statsLock;
+	Histogram latencies;
+	uint64_t failures = 0;
+
 	void recordFind(size_t node_index, size_t target_data_index, Time since) {
 		this->waiting[node_index] = false;
-		std::cout << "[E] S " << node_index << " " << target_data_index
-		          << " " << this->net.current_epoch() - since << std::endl;
+		Time took = this->net.current_epoch() - since;
+		logEvent(EventRecord::success(node_index, target_data_index, took));
+		std::lock_guard<std::mutex> guard(this->statsLock);
+		this->latencies.record(took);
 	}
 	void recordFail(size_t node_index, size_t target_data_index, Time since) {
 		this->waiting[node_index] = false;
-		std::cout << "[E] F " << node_index << " " << target_data_index
-		          << " " << this->net.current_epoch() - since << std::endl;
+		logEvent(EventRecord::failure(node_index, target_data_index,
+		                        this->net.current_epoch() - since));
+		std::lock_guard<std::mutex> guard(this->statsLock);
+		this->failures++;
 	}
 
 	std::shared_ptr<Node> create();
@@ -0,0 +1,57 @@
+#ifndef DHTSIM_FIFO_H
+#define DHTSIM_FIFO_H
+
+#include <vector>
+#include <cstddef>
+#include <utility>
+
+namespace dhtsim {
+
+/**
+ * A first-in first-out queue in a single vector, with the same
+ * interface as std::queue. std::queue's deque gives back a block of
+ * memory every time its front moves past one and takes a new one
+ * every time its back does, so a queue that fills and drains every
+ * tick allocates all the time. This one keeps its memory: once it
+ * has grown to the most it ever holds, it stops allocating.
+ */
+template <typename T> class Fifo {
+public:
+	Fifo() : head(0) {}
+
+	bool empty() const { return this->head == this->items.size(); }
+	size_t size() const { return this->items.size() - this->head; }
+
+	T& front() { return this->items[this->head]; }
+	const T& front() const { return this->items[this->head]; }
+
+	void push(T item) {
+		// Out of room: move what's left to the start before
+		// growing, if that frees up at least half.
+		if (this->items.size() == this->items.capacity() && this->head >= this->items.size() / 2) {
+			this->items.erase(this->items.begin(), this->items.begin() + this->head);
+			this->head = 0;
+		}
+		this->items.push_back(std::move(item));
+	}
+
+	void pop() {
+		// What's popped is let go of right away, not when the
+		// slot is next used.
+		this->items[this->head] = T();
+		this->head++;
+		if (this->head == this->items.size()) {
+			this->items.clear();
+			this->head = 0;
+		}
+	}
+
+private:
+	std::vector<T> items;
+	/** Where the front is in items. */
+	size_t head;
+};
+
+}
+
+#endif
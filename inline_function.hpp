@@ -0,0 +1,128 @@
+#ifndef DHTSIM_INLINE_FUNCTION_H
+#define DHTSIM_INLINE_FUNCTION_H
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace dhtsim {
+
+template <typename Signature, size_t Capacity = 64> class InlineFunction;
+
+/**
+ * A move-only std::function replacement that keeps callables of up
+ * to Capacity bytes inside itself instead of on the heap. Lambdas
+ * capturing a few pointers, a key and a bucket entry fit, so building
+ * the callbacks for an RPC doesn't allocate. Bigger callables still
+ * work; they are just heap allocated.
+ *
+ * Being move-only also means it can hold callables that are
+ * themselves move-only.
+ */
+template <typename R, typename... Args, size_t Capacity>
+class InlineFunction<R(Args...), Capacity> {
+public:
+	InlineFunction() : ops(nullptr) {}
+	InlineFunction(std::nullptr_t) : ops(nullptr) {}
+
+	template <typename F,
+	          typename = std::enable_if_t<!std::is_same<std::decay_t<F>, InlineFunction>::value>>
+	InlineFunction(F&& f) {
+		using Fn = std::decay_t<F>;
+		if constexpr (fitsInline<Fn>()) {
+			new (&this->storage) Fn(std::forward<F>(f));
+			this->ops = &InlineOps<Fn>::ops;
+		} else {
+			*reinterpret_cast<Fn**>(&this->storage) = new Fn(std::forward<F>(f));
+			this->ops = &HeapOps<Fn>::ops;
+		}
+	}
+
+	InlineFunction(InlineFunction&& other) : ops(other.ops) {
+		if (this->ops) {
+			this->ops->relocate(&other.storage, &this->storage);
+			other.ops = nullptr;
+		}
+	}
+	InlineFunction& operator=(InlineFunction&& other) {
+		if (this != &other) {
+			this->reset();
+			this->ops = other.ops;
+			if (this->ops) {
+				this->ops->relocate(&other.storage, &this->storage);
+				other.ops = nullptr;
+			}
+		}
+		return *this;
+	}
+	InlineFunction(const InlineFunction&) = delete;
+	InlineFunction& operator=(const InlineFunction&) = delete;
+
+	~InlineFunction() { this->reset(); }
+
+	R operator()(Args... args) const {
+		return this->ops->invoke(const_cast<void*>(static_cast<const void*>(&this->storage)),
+		                         std::forward<Args>(args)...);
+	}
+
+	explicit operator bool() const { return this->ops != nullptr; }
+
+	/**
+	 * Whether a callable of type Fn is kept inline. Callers on
+	 * hot paths static_assert this, so a capture that grows past
+	 * Capacity fails the build instead of quietly allocating.
+	 */
+	template <typename Fn> static constexpr bool fitsInline() {
+		return sizeof(Fn) <= Capacity && alignof(Fn) <= alignof(std::max_align_t);
+	}
+
+	void reset() {
+		if (this->ops) {
+			this->ops->destroy(&this->storage);
+			this->ops = nullptr;
+		}
+	}
+
+private:
+	struct Ops {
+		R (*invoke)(void*, Args&&...);
+		/** Move from one storage to another and destroy the source. */
+		void (*relocate)(void*, void*);
+		void (*destroy)(void*);
+	};
+
+	template <typename Fn> struct InlineOps {
+		static R invoke(void* s, Args&&... args) {
+			return (*static_cast<Fn*>(s))(std::forward<Args>(args)...);
+		}
+		static void relocate(void* from, void* to) {
+			new (to) Fn(std::move(*static_cast<Fn*>(from)));
+			static_cast<Fn*>(from)->~Fn();
+		}
+		static void destroy(void* s) {
+			static_cast<Fn*>(s)->~Fn();
+		}
+		static constexpr Ops ops = {invoke, relocate, destroy};
+	};
+
+	template <typename Fn> struct HeapOps {
+		static R invoke(void* s, Args&&... args) {
+			return (**static_cast<Fn**>(s))(std::forward<Args>(args)...);
+		}
+		static void relocate(void* from, void* to) {
+			*static_cast<Fn**>(to) = *static_cast<Fn**>(from);
+		}
+		static void destroy(void* s) {
+			delete *static_cast<Fn**>(s);
+		}
+		static constexpr Ops ops = {invoke, relocate, destroy};
+	};
+
+	alignas(std::max_align_t) unsigned char storage[Capacity];
+	const Ops* ops;
+};
+
+}
+
+#endif
@@ -4,38 +4,49 @@
 #include "message_structs.hpp"
 #include "application.hpp"
 #include "message.hpp"
+#include "log.hpp"
+#include "event_log.hpp"
+#include "metrics.hpp"
 
 #include <functional>
 #include <algorithm>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <queue>
 #include <chrono>
 #include <thread>
+#include <memory>
 
 #include <nop/structure.h>
 #include <nop/serializer.h>
-#include <nop/utility/stream_reader.h>
-#include <nop/utility/stream_writer.h>
+#include <nop/utility/buffer_reader.h>
+#include <nop/utility/buffer_writer.h>
 #include <openssl/sha.h>
 
 using namespace dhtsim;
 
-static void randomizeKey(KademliaNode::Key& k) {
+static void randomizeKey(Random::Generator& rng, KademliaNode::Key& k) {
 	// Generate a random key with SHA1
-	uint64_t randval = global_rng.Uint_64(0, std::numeric_limits<unsigned long>::max());
+	uint64_t randval = rng.Uint_64(0, std::numeric_limits<unsigned long>::max());
 	SHA1((unsigned char*) &randval, sizeof(randval), k.key);
 }
 
-KademliaNode::KademliaNode(Config config) : config(config) {
-	randomizeKey(this->key);
-
-	this->maintenance_offset = global_rng.Number(0ul, config.maintenance_period - 1);
-
-	this->buckets.resize(KEY_LEN_BITS);
-	for (unsigned i = 0; i < KEY_LEN_BITS; i++){
-		this->buckets[i].reserve(this->config.k);
-	}
+/** Give the message types readable names in the metrics. */
+static const bool message_types_named = []() {
+	Metrics::global().nameMessageType(KademliaNode::KM_PING, "ping");
+	Metrics::global().nameMessageType(KademliaNode::KM_FIND_NODES, "find_nodes");
+	Metrics::global().nameMessageType(KademliaNode::KM_FIND_VALUE, "find_value");
+	Metrics::global().nameMessageType(KademliaNode::KM_STORE, "store");
+	Metrics::global().nameMessageType(KademliaNode::KM_STORE_BATCH, "store_batch");
+	return true;
+}();
+
+KademliaNode::KademliaNode(Config config)
+	: config(config), buckets(config.k), bucket_touched(KEY_LEN_BITS, 0) {
+	randomizeKey(this->rng, this->key);
+
+	this->maintenance_offset = this->rng.Number(0ul, config.maintenance_period - 1);
 }
 
 
@@ -45,54 +56,62 @@ static KademliaNode::Key getSHA1(const std::vector<unsigned char>& value) {
 	return result;
 }
 
-/** How many trailing zeros does c have in binary? */
-static unsigned l2c(unsigned char c) {
-	unsigned result = 0;
-	for ( ; c > 0; c >>= 1, result++);
-	return result;
-}
-
 /** Longest matching binary prefix of the two keys. */
 static unsigned longest_matching_prefix(const KademliaNode::Key& k1, const KademliaNode::Key& k2) {
-	unsigned i;
-	for (i = 0; i < KademliaNode::KEY_LEN; i++) {
-		unsigned char cmp = k1.key[i] ^ k2.key[i];
-		if (cmp != 0) {
-			return (i + 1) * 8 - l2c(cmp);
-		}
-	}
-	return KademliaNode::KEY_LEN_BITS;
+	return k1.commonPrefixLength(k2);
 }
 
 /** Returns true if k1 is closer to target, false otherwise. */
 static bool key_distance_cmp(const KademliaNode::Key& target,
 			     const KademliaNode::Key& k1,
 			     const KademliaNode::Key& k2) {
-	unsigned i;
-	for (i = 0; i < KademliaNode::KEY_LEN; i++) {
-	        unsigned char k1t = k1.key[i] ^ target.key[i];
-		unsigned char k2t = k2.key[i] ^ target.key[i];
-		if (k1t != k2t) {
-			return k1t < k2t;
-		}
-	}
-
-	return false;
+	return target.closer(k1, k2);
 }
 
 
 
 void KademliaNode::tick(Time time) {
 	BaseApplication<uint32_t>::tick(time);
-	if (this->epoch % this->config.maintenance_period == this->maintenance_offset) {
+	static const auto lookups = Metrics::global().histogram("kademlia.lookups_in_progress");
+	Metrics::global().record(lookups, this->nodes_being_found.size());
+
+	if (time % this->config.maintenance_period == this->maintenance_offset) {
 		this->runTableMaintenance();
 	}
 
-	if (this->epoch % this->config.bucket_refresh_period == this->maintenance_offset % this->config.bucket_refresh_period) {
-		this->refreshBuckets(RefreshCallbackSet());
+	if (time % this->config.bucket_refresh_period == this->maintenance_offset % this->config.bucket_refresh_period) {
+		// How hot this node is: values it handed out over the
+		// last period.
+		static const auto served = Metrics::global().histogram("kademlia.values_served");
+		Metrics::global().record(served, this->values_served);
+		this->values_served = 0;
+	}
+
+	if (time >= this->next_refresh) {
+		this->refreshBuckets();
 	}
 }
 
+/** The first time strictly after now that is congruent to offset mod period. */
+static Time nextOccurrence(Time now, Time period, Time offset) {
+	Time next = now - now % period + offset;
+	if (next <= now) next += period;
+	return next;
+}
+
+Time KademliaNode::nextWakeup() {
+	if (this->isDead()) return NEVER;
+
+	Time now = this->now();
+	Time next = BaseApplication<uint32_t>::nextWakeup();
+	next = std::min(next, nextOccurrence(now, this->config.maintenance_period,
+	                                     this->maintenance_offset));
+	next = std::min(next, nextOccurrence(now, this->config.bucket_refresh_period,
+	                                     this->maintenance_offset % this->config.bucket_refresh_period));
+	next = std::min(next, std::max(now + 1, this->next_refresh));
+	return next;
+}
+
 static void sortByDistanceTo(const KademliaNode::Key& target,
                              std::vector<BucketEntry>& bucket) {
 
@@ -121,22 +140,59 @@ std::vector<BucketEntry> KademliaNode::getNearest(
 	return this->getNearest(n, target, this->getKey());
 }
 
+/*
+ * Buckets can be visited in order of distance to the target without
+ * looking at the keys in them. Say the target shares a p bit prefix
+ * with our key. Then:
+ *
+ *  - everything in bucket p shares at least p+1 bits with the
+ *    target, so it's closer than anything else;
+ *  - everything in buckets p+1 and up first differs from the target
+ *    at bit p, so those buckets come next, as one group;
+ *  - everything in a bucket b < p first differs from the target at
+ *    bit b, so buckets p-1 down to 0 come last, in that order.
+ *
+ * Only the groups needed to get n entries are collected and sorted.
+ */
 std::vector<BucketEntry> KademliaNode::getNearest(
 	unsigned n, const Key& target, const Key& exclude) {
 
-	std::vector<BucketEntry> entries, result;
-	unsigned i;
-	for (i = 0; i < KEY_LEN; i++) {
-		for (const auto &entry : this->buckets[i]) {
+	std::vector<BucketEntry> result;
+	result.reserve(n);
+	auto& group = this->nearest_scratch;
+
+	auto collect = [this, &group, &exclude](unsigned bucket_index) {
+		for (const auto &entry : this->buckets.bucket(bucket_index)) {
 			if (!(entry.key == exclude)) {
-				entries.push_back(entry);
+				group.push_back(entry);
 			}
 		}
+	};
+	auto take = [&result, &group, &target, n]() {
+		size_t want = std::min<size_t>(n - result.size(), group.size());
+		std::partial_sort(group.begin(), group.begin() + want, group.end(),
+		                  [&target](const BucketEntry& e1, const BucketEntry& e2) {
+			                  return key_distance_cmp(target, e1.key, e2.key);
+		                  });
+		result.insert(result.end(), group.begin(), group.begin() + want);
+		group.clear();
+	};
+
+	unsigned p = longest_matching_prefix(this->key, target);
+	unsigned i;
+	if (p < KEY_LEN_BITS && result.size() < n) {
+		collect(p);
+		take();
+	}
+	if (result.size() < n) {
+		for (i = p + 1; i < KEY_LEN_BITS; i++) {
+			collect(i);
+		}
+		take();
 	}
-	sortByDistanceTo(target, entries);
-	for (i = 0; i < entries.size(); i++) {
-		if (i >= n) break;
-		result.push_back(entries[i]);
+	for (i = std::min(p, KEY_LEN_BITS); i-- > 0 && result.size() < n; ) {
+		collect(i);
+		take();
 	}
 	return result;
 }
@@ -144,33 +200,59 @@ std::vector<BucketEntry> KademliaNode::getNearest(
 void KademliaNode::ping(uint32_t other_address, PingCallbackSet callback) {
 	auto cb_it = this->pings_in_progress.find(other_address);
 	if (cb_it != this->pings_in_progress.end()) {
-		cb_it->second += callback;
+		cb_it->second.callback += std::move(callback);
 		return;
 	} else {
-		this->pings_in_progress[other_address] = callback;
+		this->pings_in_progress.emplace(other_address,
+		                                PendingPing{std::move(callback), {}});
 	}
+	this->sendPing(other_address);
+}
 
-	Message<uint32_t> m(KM_PING, this->getAddress(), other_address, 0,
-	                    std::vector<unsigned char>());
+void KademliaNode::sendPing(uint32_t other_address) {
+	Message<uint32_t> m(KM_PING, this->getAddress(), other_address, 0);
 	PingMessage pm = PingMessage::ping();
 	pm.sender = this->getKey();
-	m.data.resize(KEY_LEN + 20);
 	writeToMessage(pm, m);
 
 
-	auto cb_success = [this, other_address, callback](Message<uint32_t> m) {
+	this->send(std::move(m), this->pingCallback(other_address), 1, 2);
+}
+
+KademliaNode::SendCallbackSet KademliaNode::pingCallback(uint32_t other_address) {
+	// The callbacks stay in pings_in_progress, so that ones added
+	// while this ping is out get called too.
+	auto cb_success = [this, other_address](Message<uint32_t> m) {
 		                 (void) m;
-		                 this->pings_in_progress.erase(other_address);
-		                 callback.success(0);
+		                 auto ping = this->takePing(other_address);
+		                 ping.callback.success(0);
 	                 };
-	auto cb_failure = [this, callback, other_address](Message<uint32_t> m) {
+	auto cb_failure = [this, other_address](Message<uint32_t> m) {
 				 (void) m;
-		                 this->pings_in_progress.erase(other_address);
+		                 auto ping = this->takePing(other_address);
 				 this->unobserve(other_address);
-				 callback.failure(1);
+				 // Whoever was waiting for its place gets it.
+				 for (const auto& r : ping.replacements) {
+					 if (!this->buckets.touch(r.bucket_index, r.entry)) {
+						 this->buckets.add(r.bucket_index, r.entry);
+					 }
+				 }
+				 ping.callback.failure(1);
 			 };
+	static_assert(SendCallbackSet::SuccessFn::fitsInline<decltype(cb_success)>()
+	              && SendCallbackSet::FailureFn::fitsInline<decltype(cb_failure)>(),
+	              "ping callbacks don't fit inline");
+	return SendCallbackSet(std::move(cb_success), std::move(cb_failure));
+}
 
-	this->send(m, SendCallbackSet(cb_success, cb_failure), 1, 2);
+KademliaNode::PendingPing KademliaNode::takePing(uint32_t other_address) {
+	auto cb_it = this->pings_in_progress.find(other_address);
+	if (cb_it == this->pings_in_progress.end()) {
+		return PendingPing();
+	}
+	PendingPing ping = std::move(cb_it->second);
+	this->pings_in_progress.erase(cb_it);
+	return ping;
 }
 
 /* One step in the find_nodes operation.  This function is quite
@@ -180,33 +262,35 @@ void KademliaNode::ping(uint32_t other_address, PingCallbackSet callback) {
  * It first retrieves the "node finder" from the table stored on the
  * node. This holds temporary information about the status of the
  * find_nodes operation. Then, it adds the newly learned-of nodes to
- * the list of uncontacted nodes. If there are no more uncontacted
- * nodes and no more nodes are being waited on, then we mark the
- * process as over and return early.
+ * the list of uncontacted nodes. If the k closest nodes seen so far
+ * have all responded, and nothing closer than them is left to ask or
+ * is still being waited on, then we mark the process as over and
+ * return early.
  *
- * Otherwise, we repeatedly remove an element from the list of
- * uncontacted nodes (sorted by distance to the target) until we get
- * one we haven't queried before, and then send a FIND_NODES message
- * to it. When it responds with its k-nearest nodes, this function is
- * called semi-recursively. I say semi-recursively because it's
- * scheduled to be called in a callback. Therefore, it doesn't
- * actually deepen the stack, as callbacks are all resolved at the
- * same stack level. */
+ * Otherwise, we take the closest nodes off the list of uncontacted
+ * nodes (sorted by distance to the target, and no longer than
+ * k * NodeFinder::SHORTLIST_FACTOR) and send each a
+ * FIND_NODES message, until alpha of them are outstanding. When one
+ * responds with its k-nearest nodes, or times out, this function is
+ * called semi-recursively and the window is topped up again. I say
+ * semi-recursively because it's scheduled to be called in a
+ * callback. Therefore, it doesn't actually deepen the stack, as
+ * callbacks are all resolved at the same stack level. */
 void KademliaNode::findNodesStep(const Key& target, const std::vector<BucketEntry>& new_nodes) {
 	// Retrive the node finder
 	auto nf_it = this->nodes_being_found.find(target);
 	if (nf_it == this->nodes_being_found.end()) {
-		std::clog << "Attempt to call findNodesStep without valid key" << std::endl;
+		logStream() << "Attempt to call findNodesStep without valid key" << std::endl;
 		return;
 	}
 
 	// Add the newly learned-of nodes to the uncontacted list, but
 	// only if they're unseen. They will be contacted later.
 	NodeFinder& nf = nf_it->second;
+	unsigned int limit = this->config.k * NodeFinder::SHORTLIST_FACTOR;
 	for (auto& entry : new_nodes) {
-		if (nf.seen.find(entry.key) == nf.seen.end()) {
-			nf.uncontacted.push_back(entry);
-			nf.seen.insert(entry.key);
+		if (nf.seen.insert(entry.key)) {
+			nf.shortlist(entry, limit);
 		}
 	}
 
@@ -216,9 +300,22 @@ void KademliaNode::findNodesStep(const Key& target, const std::vector<BucketEntr
 	          << " uncontacted " << nf.uncontacted.size() << std::endl;
 #endif
 
+	// Once k nodes have responded, only nodes closer to the target
+	// than the farthest of them can still change the result.
+	unsigned int k = this->config.k;
+	auto worth_asking = [&target, k](const NodeFinder& nf, const BucketEntry& entry) {
+		return nf.closest.size() < k
+			|| key_distance_cmp(target, entry.key, nf.closest.front().key);
+	};
+
 	// Stopping condition
-	if (nf.uncontacted.empty()) {
-		if (nf.waiting == 0) {
+	bool candidates = !nf.uncontacted.empty() && worth_asking(nf, nf.uncontacted.back());
+	if (!candidates) {
+		bool pending = false;
+		for (const auto& entry : nf.in_flight) {
+			pending = pending || worth_asking(nf, entry);
+		}
+		if (!pending) {
 			if (nf.find_value) {
 				this->findNodesFail(target);
 			} else {
@@ -233,25 +330,37 @@ void KademliaNode::findNodesStep(const Key& target, const std::vector<BucketEntr
                 return;
 	}
 
-	sortByDistanceTo(target, nf.uncontacted);
-
-	// Pull off as many as necessary to get a new one, and query it.
-	BucketEntry top;
+	// Keep up to alpha queries in flight, against the closest
+	// nodes we know of. Sending can call back into this function
+	// right away (when this node is dead, for instance) and that
+	// may finish the lookup, so look the finder up every time.
+	unsigned int alpha = std::max(1u, this->config.alpha);
 	while (true) {
-		if (nf.uncontacted.empty()) {
-			return;
-		}
-
-		auto first_it = nf.uncontacted.begin();
-		top = *first_it;
-		nf.uncontacted.erase(first_it);
-
-		break;
+		nf_it = this->nodes_being_found.find(target);
+		if (nf_it == this->nodes_being_found.end()) return;
+		NodeFinder& finder = nf_it->second;
+		if (finder.waiting >= alpha || finder.uncontacted.empty()) return;
+		if (!worth_asking(finder, finder.uncontacted.back())) return;
+
+		// Everything in the list is unseen, so the closest one
+		// is the next to query.
+		BucketEntry top = finder.uncontacted.back();
+		finder.uncontacted.pop_back();
+
+		// This is to tell whether we have more callbacks that
+		// need to complete.
+		finder.waiting++;
+		finder.queries++;
+		finder.max_in_flight = std::max(finder.max_in_flight, finder.waiting);
+		finder.in_flight.push_back(top);
+
+		this->findNodesQuery(target, top);
 	}
+}
 
-	// This is to tell whether we have more callbacks that need to
-	// complete.
-        nf.waiting++;
+/** Send one FIND_NODES query on behalf of the lookup for target. */
+void KademliaNode::findNodesQuery(const Key& target, const BucketEntry& top) {
+	auto nf_it = this->nodes_being_found.find(target);
 
         // Message building boilerplate.
 	Message<uint32_t> m;
@@ -264,11 +373,16 @@ void KademliaNode::findNodesStep(const Key& target, const std::vector<BucketEntr
 	fm.request = true;
 	fm.sender = this->getKey();
 	fm.target = target;
-	fm.find_value = nf.find_value;
+	fm.find_value = nf_it->second.find_value;
 	fm.num_found = 0;
 
 	writeToMessage(fm, m);
 
+	this->send(std::move(m), this->findNodesQueryCallback(target, top), 1, 2);
+}
+
+KademliaNode::SendCallbackSet KademliaNode::findNodesQueryCallback(const Key& target,
+                                                                   const BucketEntry& top) {
 	// lambda captures kept to a minimum
 	auto cbSuccess =
 		[this, target, top](Message<uint32_t> m) {
@@ -276,11 +390,10 @@ void KademliaNode::findNodesStep(const Key& target, const std::vector<BucketEntr
 			auto nf_it = this->nodes_being_found.find(target);
 			if (nf_it == this->nodes_being_found.end()) return;
 			auto& nf = nf_it->second;
-			nf.contacted.push_back(top);
-                        nf.waiting--;
+			nf.responded(target, top, this->config.k);
                         readFromMessage(fm, m);
                         if (fm.find_value && fm.value_found) {
-	                        this->findNodesFinish(target, fm.value);
+	                        this->findNodesFinish(target, fm.value, top);
                         } else {
 				this->findNodesStep(target, fm.nearest);
                         }
@@ -294,70 +407,182 @@ void KademliaNode::findNodesStep(const Key& target, const std::vector<BucketEntr
 			auto nf_it = this->nodes_being_found.find(target);
 			if (nf_it == this->nodes_being_found.end()) return;
 			auto& nf = nf_it->second;
-                        nf.waiting--;
+			nf.failed(top);
 			this->findNodesStep(target, {});
 		};
+	// Every lookup query builds these; they must not allocate.
+	static_assert(SendCallbackSet::SuccessFn::fitsInline<decltype(cbSuccess)>()
+	              && SendCallbackSet::FailureFn::fitsInline<decltype(cbFailure)>(),
+	              "lookup query callbacks don't fit inline");
+	return SendCallbackSet(std::move(cbSuccess), std::move(cbFailure));
+}
+void KademliaNode::NodeFinder::responded(const Key& target, const BucketEntry& entry,
+                                         unsigned int k) {
+	this->settle(entry);
+	// Keep the k closest, with the farthest of them on top.
+	auto closer = [&target](const BucketEntry& e1, const BucketEntry& e2) {
+		              return key_distance_cmp(target, e1.key, e2.key);
+	              };
+	this->contacted.push_back(entry);
+	this->closest.push_back(entry);
+	std::push_heap(this->closest.begin(), this->closest.end(), closer);
+	if (this->closest.size() > k) {
+		std::pop_heap(this->closest.begin(), this->closest.end(), closer);
+		this->closest.pop_back();
+	}
+}
+
+void KademliaNode::NodeFinder::shortlist(const BucketEntry& entry, unsigned int limit) {
+	// Sorted from the farthest to the closest, so the next node to
+	// query comes off the back and the one to drop is at the front.
+	const Key& target = this->target;
+	auto farther = [&target](const BucketEntry& e1, const BucketEntry& e2) {
+		               return key_distance_cmp(target, e2.key, e1.key);
+	               };
+	auto pos = std::upper_bound(this->uncontacted.begin(), this->uncontacted.end(),
+	                            entry, farther);
+	if (this->uncontacted.size() < limit) {
+		this->uncontacted.insert(pos, entry);
+		return;
+	}
+
+	// Full: drop the farthest, which may be the new one. The rest
+	// shift over into the room it leaves.
+	this->dropped++;
+	if (pos == this->uncontacted.begin()) return;
+	std::move(this->uncontacted.begin() + 1, pos, this->uncontacted.begin());
+	*(pos - 1) = entry;
+}
 
-	this->send(m, SendCallbackSet(cbSuccess, cbFailure), 1, 2);
+void KademliaNode::NodeFinder::failed(const BucketEntry& entry) {
+	this->settle(entry);
 }
+
+void KademliaNode::NodeFinder::settle(const BucketEntry& entry) {
+	this->waiting--;
+	for (auto it = this->in_flight.begin(); it != this->in_flight.end(); it++) {
+		if (it->address == entry.address) {
+			*it = this->in_flight.back();
+			this->in_flight.pop_back();
+			break;
+		}
+	}
+}
+
 void KademliaNode::findNodesStart(const Key& target) {
 	auto nearest = this->getNearest(this->config.k, target);
 	this->findNodesStep(target, nearest);
 }
 
+void KademliaNode::findNodesReport(const NodeFinder& nf) {
+	// Everything left uncontacted or dropped is a query the old
+	// "ask everyone" rule would have sent and we didn't.
+	logEvent(EventRecord::lookup(this->getAddress(), nf.queries, nf.max_in_flight,
+	                       this->now() - nf.started,
+	                       nf.uncontacted.size() + nf.dropped));
+}
+
 void KademliaNode::findNodesFail(const Key& target) {
 	auto nf_it = this->nodes_being_found.find(target);
+	this->findNodesReport(nf_it->second);
 	FindNodesMessage fm;
         fm.find_value = true;
 	fm.value_found = false;
-	nf_it->second.find_nodes_callback.failure(fm);
+	// The finder is gone before the callbacks run, so they can
+	// start a new search for the same key.
+	auto callback = std::move(nf_it->second.find_nodes_callback);
 	this->nodes_being_found.erase(nf_it);
+	callback.failure(fm);
 }
 
 void KademliaNode::findNodesFinish(const Key& target) {
 	auto nf_it = this->nodes_being_found.find(target);
+	this->findNodesReport(nf_it->second);
 	sortByDistanceTo(target, nf_it->second.contacted);
 	FindNodesMessage result;
 	result.request = false;
 	result.find_value = false;
 	result.num_found = nf_it->second.contacted.size();
-	result.nearest = nf_it->second.contacted;
-	nf_it->second.find_nodes_callback.success(result);
-	this->nodes_being_found.erase(target);
+	result.nearest = std::move(nf_it->second.contacted);
+	auto callback = std::move(nf_it->second.find_nodes_callback);
+	this->nodes_being_found.erase(nf_it);
+	callback.success(result);
 }
 
-void KademliaNode::findNodesFinish(const Key& target, const std::vector<unsigned char>& value) {
+void KademliaNode::findNodesFinish(const Key& target, const std::vector<unsigned char>& value,
+                                   const BucketEntry& holder) {
 	auto nf_it = this->nodes_being_found.find(target);
+	this->findNodesReport(nf_it->second);
+	static const auto queries = Metrics::global().histogram("kademlia.find_value_queries");
+	Metrics::global().record(queries, nf_it->second.queries);
+	if (this->config.cache_period > 0) {
+		this->cacheValue(nf_it->second, value, holder);
+	}
 	FindNodesMessage result;
 	result.request = false;
 	result.find_value = true;
 	result.value_found = true;
 	result.value = value;
-	nf_it->second.find_nodes_callback.success(result);
-	this->nodes_being_found.erase(target);
+	auto callback = std::move(nf_it->second.find_nodes_callback);
+	this->nodes_being_found.erase(nf_it);
+	callback.success(result);
+}
+
+/*
+ * Caching as in the Kademlia paper: a copy goes to the closest node
+ * the lookup asked that didn't have the value, so later lookups for a
+ * popular key find it before they get to the nodes responsible for
+ * it. The copy lasts for less the farther that node is from the key
+ * compared with the one the value came from: cache_period, halved
+ * for every bit of prefix with the key it has fewer.
+ */
+void KademliaNode::cacheValue(const NodeFinder& nf, const std::vector<unsigned char>& value,
+                              const BucketEntry& holder) {
+	const BucketEntry* closest = nullptr;
+	for (const auto& entry : nf.contacted) {
+		if (entry.address == holder.address) continue;
+		if (closest == nullptr || key_distance_cmp(nf.target, entry.key, closest->key)) {
+			closest = &entry;
+		}
+	}
+	if (closest == nullptr) return;
+
+	unsigned int prefix = longest_matching_prefix(closest->key, nf.target);
+	unsigned int holder_prefix = longest_matching_prefix(holder.key, nf.target);
+	unsigned int shift = holder_prefix > prefix ? holder_prefix - prefix : 0;
+	Time cache_for = shift < 64 ? this->config.cache_period >> shift : 0;
+	if (cache_for == 0) return;
+
+	static const auto stores = Metrics::global().counter("kademlia.cache_stores");
+	Metrics::global().add(stores);
+	this->store(closest->address, value, cache_for);
 }
 
 void KademliaNode::findNodes(const Key& target, FindNodesCallbackSet callback) {
+	this->touchBucket(target);
 	auto loc = this->nodes_being_found.find(target);
 	if (loc != this->nodes_being_found.end()) {
-		loc->second.find_nodes_callback += callback;
+		loc->second.find_nodes_callback += std::move(callback);
 		return;
 	}
 
-	NodeFinder nf(target, callback);
-	this->nodes_being_found[target] = nf;
+	NodeFinder nf(target, std::move(callback));
+	nf.started = this->now();
+	this->nodes_being_found.emplace(target, std::move(nf));
 	this->findNodesStart(target);
 }
 void KademliaNode::findValue(const Key& target, FindNodesCallbackSet callback) {
+	this->touchBucket(target);
 	auto loc = this->nodes_being_found.find(target);
 	if (loc != this->nodes_being_found.end()) {
-		loc->second.find_nodes_callback += callback;
+		loc->second.find_nodes_callback += std::move(callback);
 		return;
 	}
 
-	NodeFinder nf(target, callback);
+	NodeFinder nf(target, std::move(callback));
 	nf.find_value = true;
-	this->nodes_being_found[target] = nf;
+	nf.started = this->now();
+	this->nodes_being_found.emplace(target, std::move(nf));
 	this->findNodesStart(target);
 }
 
@@ -377,50 +602,132 @@ KademliaNode::Key KademliaNode::store(const std::vector<unsigned char>& value) {
 		                  (void)m;
 	                  };
 
-	this->findNodes(store_under, FindNodesCallbackSet(cb_success, cb_failure));
+	this->findNodes(store_under, FindNodesCallbackSet(std::move(cb_success), cb_failure));
 	return store_under;
 }
 KademliaNode::Key KademliaNode::store(uint32_t target_address,
-                         const std::vector<unsigned char>& value) {
+                         const std::vector<unsigned char>& value, Time cache_for) {
 	StoreMessage sm;
 	sm.request = 1;
 	sm.sender = this->getKey();
 	sm.value = value;
+	sm.cache_for = cache_for;
 
-	Message<uint32_t> m(KM_STORE, this->getAddress(), target_address, 0, {});
+	Message<uint32_t> m(KM_STORE, this->getAddress(), target_address, 0);
 	writeToMessage(sm, m);
 
-	this->send(m);
+	this->send(std::move(m));
 	return getSHA1(value);
 }
 
-void KademliaNode::storeValue(const Key& store_under, const std::vector<unsigned char>& value) {
-	auto loc = this->table.find(store_under);
-	if (loc != this->table.end()) {
-		loc->second.last_touch = this->epoch;
+void KademliaNode::storeBatch(uint32_t target_address, const std::vector<Key>& keys) {
+	StoreBatchMessage sm;
+	sm.request = true;
+	sm.sender = this->getKey();
+	// Leave room for the lengths of the two lists to grow.
+	const size_t empty = nop::Encoding<StoreBatchMessage>::Size(sm) + 2 * 8;
+	size_t size = empty;
+	// Whatever the configuration says, a batch the network
+	// drops is no use.
+	const size_t limit = std::min<size_t>(this->config.store_batch, this->maxMessageSize());
+
+	auto flush = [this, target_address, &sm, &size, empty]() {
+		Message<uint32_t> m(KM_STORE_BATCH, this->getAddress(), target_address, 0);
+		writeToMessage(sm, m);
+		// A lost batch is sent again, after as long as a
+		// batch stuck behind others in the uplink may take.
+		this->send(std::move(m), this->storeBatchCallback(), 2);
+		sm.keys.clear();
+		sm.values.clear();
+		size = empty;
+	};
+
+	for (const auto& key : keys) {
+		const auto& value = *this->table.find(key)->value;
+		size_t more = nop::Encoding<Key>::Size(key)
+			+ nop::Encoding<std::vector<unsigned char>>::Size(value);
+		// A value too big for a batch of its own still goes,
+		// alone, like a STORE would.
+		if (!sm.keys.empty() && size + more > limit) {
+			flush();
+		}
+		sm.keys.push_back(key);
+		sm.values.push_back(value);
+		size += more;
+	}
+	if (!sm.keys.empty()) {
+		flush();
+	}
+}
+
+KademliaNode::SendCallbackSet KademliaNode::storeBatchCallback() {
+	auto cb_success = [](Message<uint32_t> m) {
+		                  static const auto stored =
+			                  Metrics::global().counter("kademlia.batch_values_stored");
+		                  StoreBatchMessage sm;
+		                  if (readFromMessage(sm, m)) {
+			                  Metrics::global().add(stored, sm.stored);
+		                  }
+	                  };
+	auto cb_failure = [](Message<uint32_t> m) {
+		                  (void) m;
+		                  static const auto lost =
+			                  Metrics::global().counter("kademlia.batches_lost");
+		                  Metrics::global().add(lost);
+	                  };
+	return SendCallbackSet(cb_success, cb_failure);
+}
+
+void KademliaNode::storeValue(const Key& store_under, const std::vector<unsigned char>& value,
+                              Time cache_for) {
+	Time expires = cache_for == 0 ? NEVER : this->now() + cache_for;
+	auto loc = this->storedValue(store_under);
+	if (loc != nullptr) {
+		if (cache_for == 0) {
+			// A real store makes a cached copy ours to keep.
+			loc->last_touch = this->now();
+			loc->expires = NEVER;
+		} else if (loc->expires != NEVER) {
+			loc->expires = std::max(loc->expires, expires);
+		}
 		return;
 	}
 	KademliaNode::TableEntry table_entry;
-	table_entry.value = value;
-	table_entry.last_touch = this->epoch;
-	table_entry.added = this->epoch;
+	table_entry.value = ValueStore::global().intern(store_under, value);
+	table_entry.last_touch = this->now();
+	table_entry.added = this->now();
+	table_entry.expires = expires;
+
+	this->table.insert(store_under, std::move(table_entry));
+}
 
-	this->table[store_under] = table_entry;
+KademliaNode::TableEntry* KademliaNode::storedValue(const Key& key) {
+	auto loc = this->table.find(key);
+	if (loc != nullptr && this->now() >= loc->expires) {
+		this->table.erase(key);
+		return nullptr;
+	}
+	return loc;
 }
 
 void KademliaNode::handleMessage(const Message<uint32_t>& m, FindNodesMessage& fm) {
 	auto resp = m;
 	if (fm.request) {
 		// First, check the request is for a value and if we have that value.
-		auto loc = this->table.find(fm.target);
-		if (fm.find_value && loc != this->table.end()) {
+		auto loc = fm.find_value ? this->storedValue(fm.target) : nullptr;
+		if (loc != nullptr) {
 #ifdef DEBUG
 			std::clog << "[" << fm.sender << "] " << this->getKey()
 			          << ".find_value(" << fm.target << ") FOUND!\n";
 #endif
 
 			fm.value_found = true;
-			fm.value = loc->second.value;
+			fm.value = *loc->value;
+			this->values_served++;
+			if (loc->expires != NEVER) {
+				static const auto hits = Metrics::global().counter("kademlia.cache_hits");
+				Metrics::global().add(hits);
+			}
 		} else {
 
 #ifdef DEBUG
@@ -439,7 +746,7 @@ void KademliaNode::handleMessage(const Message<uint32_t>& m, FindNodesMessage& f
 		writeToMessage(fm, resp);
 		resp.destination = m.originator;
 		resp.originator = m.destination;
-		this->send(resp);
+		this->send(std::move(resp));
 	} else {
 		for (const auto &entry : fm.nearest) {
 			// std::clog << "Observed " << entry.key
@@ -473,18 +780,20 @@ void KademliaNode::handleMessage(const Message<uint32_t>& m) {
 			resp.destination = m.originator;
 			resp.originator = this->getAddress();
 			writeToMessage(outbound, resp);
-			this->send(resp);
+			this->send(std::move(resp));
 		}
 		break;
 	}
 	case KM_FIND_NODES: {
 		if (m.data.size() < 1+KEY_LEN+4) {
-			std::clog << "malformed find_nodes (too short)" << std::endl;
+			logStream() << "malformed find_nodes (too short)" << std::endl;
 			break;
 		}
 		FindNodesMessage fm;
-		// This is unsafe. Out of bounds reads may happen.
-		readFromMessage(fm, m);
+		if (!readFromMessage(fm, m)) {
+			logStream() << "malformed find_nodes" << std::endl;
+			break;
+		}
 		// Observe
 		sender = fm.sender;
 		this->observe(m.originator, sender);
@@ -492,6 +801,34 @@ void KademliaNode::handleMessage(const Message<uint32_t>& m) {
 		this->handleMessage(m, fm);
 		break;
 	}
+	case KM_STORE_BATCH: {
+		StoreBatchMessage sm;
+		if (!readFromMessage(sm, m) || sm.keys.size() != sm.values.size()) {
+			logStream() << "malformed store_batch" << std::endl;
+			break;
+		}
+		this->observe(m.originator, sm.sender);
+
+		if (sm.request) {
+			// The keys come with the values, so there's no
+			// hashing every value again.
+			for (size_t i = 0; i < sm.keys.size(); i++) {
+				this->storeValue(sm.keys[i], sm.values[i]);
+			}
+
+			// One answer for the whole batch.
+			sm.request = false;
+			sm.stored = sm.keys.size();
+			sm.keys.clear();
+			sm.values.clear();
+			sm.sender = this->getKey();
+			auto resp = m;
+			std::swap(resp.originator, resp.destination);
+			writeToMessage(sm, resp);
+			this->send(std::move(resp));
+		}
+		break;
+	}
 	case KM_STORE: {
 		StoreMessage sm;
 		readFromMessage(sm, m);
@@ -503,21 +840,22 @@ void KademliaNode::handleMessage(const Message<uint32_t>& m) {
 			std::clog << "[" << sm.sender << "] " << this->getKey() << ".store("
 			          << store_under << ")\n";
 #endif
-			this->storeValue(store_under, sm.value);
+			this->storeValue(store_under, sm.value, sm.cache_for);
 
 			sm.request = false;
 			sm.value.clear();
+			sm.cache_for = 0;
 			sm.sender = this->getKey();
 			auto resp = m;
 			std::swap(resp.originator, resp.destination);
 			writeToMessage(sm, resp);
-			this->send(resp);
+			this->send(std::move(resp));
 		}
 
 		break;
 	}
 	default:
-		std::clog << "received an unknown message!" << std::endl;
+		logStream() << "received an unknown message!" << std::endl;
 	}
 }
 
@@ -526,28 +864,21 @@ void KademliaNode::updateOrAddToBucket(unsigned bucket_index, BucketEntry new_en
 		return;
 	}
 
-	auto& bucket = this->buckets[bucket_index];
-
 	// Case 1: We have already seen the key of the new entry: we
-	// just need to delete that entry and add this one.
-
-	auto it = bucket.begin();
-	for ( ; it != bucket.end(); it++) {
-		if (it->key == new_entry.key) {
-			it = bucket.erase(it);
-			bucket.push_back(new_entry);
-			//std::clog << "[" << this->getKey() << "]"
-			//	  << " hoisted in bucket " << bucket_index << ": "
-			//	  << new_entry.key << std::endl;
-			return;
-		}
+	// just need to replace that entry and make it the most
+	// recently seen.
+
+	if (this->buckets.touch(bucket_index, new_entry)) {
+		//std::clog << "[" << this->getKey() << "]"
+		//	  << " hoisted in bucket " << bucket_index << ": "
+		//	  << new_entry.key << std::endl;
+		return;
 	}
 
 	// Case 2: We have not seen the key of the new entry, but there is
 	// still space left to add a new key.
 
-	if (bucket.size() < this->config.k) {
-		bucket.push_back(new_entry);
+	if (this->buckets.add(bucket_index, new_entry)) {
 		//std::clog << "[" << this->getKey() << "]"
 		//          << " added to bucket " << bucket_index << ": "
 		//          << new_entry.key << std::endl;
@@ -557,28 +888,17 @@ void KademliaNode::updateOrAddToBucket(unsigned bucket_index, BucketEntry new_en
 	// Case 3: We have not esen the key of the new entry, and
 	// there is no space left.
 
-	// Ping the least-recently seen node:
-	auto lrs_address = bucket[0].address;
-	std::vector<unsigned char> data;
-
-	// If the node responds, we hoist it to the most recently seen
-	// position, and drop the new entry.
-        auto cbSuccess =
-	        [](auto m) {
-		        (void) m; // unused
-		};
-
-        // If the node fails to respond, we delete it and add the new
-        // entry.
-        auto cbFail =
-	        [this, bucket_index, new_entry] (auto m) {
-		        (void) m; // unused
-		        this->buckets[bucket_index].erase(
-			        this->buckets[bucket_index].begin());
-		        this->buckets[bucket_index].push_back(new_entry);
-		};
-
-        this->ping(lrs_address, PingCallbackSet(cbSuccess, cbFail));
+	// Ping the least-recently seen node. If it responds, it
+	// stays and the new entry is dropped. If it doesn't, pingCallback
+	// deletes it and adds the new entry, going by address rather
+	// than position since the bucket may change while the ping is
+	// out.
+	auto lrs_address = this->buckets.bucket(bucket_index).front().address;
+	auto pending = this->pings_in_progress.try_emplace(lrs_address);
+	pending.first->second.replacements.push_back({bucket_index, new_entry});
+	if (pending.second) {
+		this->sendPing(lrs_address);
+	}
 }
 
 void KademliaNode::observe(uint32_t other_address, const KademliaNode::Key& other_key) {
@@ -586,33 +906,41 @@ void KademliaNode::observe(uint32_t other_address, const KademliaNode::Key& othe
 	BucketEntry entry;
 	entry.key = other_key;
 	entry.address = other_address;
-	entry.lastSeen = this->epoch;
+	entry.lastSeen = this->now();
+	this->touchBucket(other_key);
 	updateOrAddToBucket(which_bucket, entry);
 }
 void KademliaNode::unobserve(uint32_t other_address) {
-	// Search all buckets for that address:
-	for (auto& bucket : this->buckets) {
-		for (auto it = bucket.begin(); it != bucket.end(); ) {
-			if (it->address == other_address) {
-				it = bucket.erase(it);
-			} else {
-				++it;
-			}
-		}
-	}
+	this->buckets.remove(other_address);
 }
 
 void KademliaNode::runTableMaintenance() {
-	// Check if any of our table entries are stale.
-	std::map<Key, TableEntry>::iterator it;
-
-	// for-filter pattern: iteration happens inside the body.
-	for (it = this->table.begin(); it != this->table.end(); ) {
-		const auto& entry = it->second;
+	// Check if any of our table entries are stale. Go through
+	// them in key order so that what gets sent when doesn't depend
+	// on the layout of the table.
+	std::vector<Key> keys;
+	keys.reserve(this->table.size());
+	this->table.forEach([&keys](const Key& key, const TableEntry&) {
+		keys.push_back(key);
+	});
+	std::sort(keys.begin(), keys.end());
+
+	// What each node gets sent, with the nodes in the order they
+	// first come up, so that it can all go in a few batches.
+	std::vector<uint32_t> destinations;
+	std::unordered_map<uint32_t, std::vector<Key>> republish;
+
+	for (const auto& key : keys) {
+		const auto& entry = *this->table.find(key);
+		// Cached copies are never passed on, they just expire.
+		if (entry.expires != NEVER) {
+			this->storedValue(key);
+			continue;
+		}
 		// I use addition instead of subtraction here to avoid
 		// unsigned underflow.
-		if (this->epoch >= this->config.maintenance_period + entry.last_touch) {
-			it = this->table.erase(it);
+		if (this->now() >= this->config.maintenance_period + entry.last_touch) {
+			this->table.erase(key);
 		} else {
 			// Instead of doing a normal store, we can
 			// just get the k nearest nodes to us in our
@@ -622,67 +950,261 @@ void KademliaNode::runTableMaintenance() {
 			// optimization, because I do bucket refreshes
 			// quite often.
 			if (entry.added <= entry.last_touch) {
-				auto bucket_entries = this->getNearest(this->config.k, it->first);
+				auto bucket_entries = this->getNearest(this->config.k, key);
 				for (const auto& bucket_entry : bucket_entries) {
-					this->store(bucket_entry.address, entry.value);
+					if (this->config.store_batch == 0) {
+						this->store(bucket_entry.address, *entry.value);
+						continue;
+					}
+					auto& batch = republish[bucket_entry.address];
+					if (batch.empty()) {
+						destinations.push_back(bucket_entry.address);
+					}
+					batch.push_back(key);
 				}
 			}
-			it++;
 		}
 	}
+
+	for (auto address : destinations) {
+		this->storeBatch(address, republish[address]);
+	}
+}
+
+void KademliaNode::touchBucket(const Key& key) {
+	unsigned int b = longest_matching_prefix(this->key, key);
+	if (b < KEY_LEN_BITS) {
+		this->bucket_touched[b] = this->now();
+	}
 }
 
 void KademliaNode::refreshSingleBucket(unsigned int bucket_index, RefreshCallbackSet cb) {
-	this->buckets[bucket_index];
+	// Keep the first bucket_index bits of our key and flip the
+	// one after them, so that k falls in this bucket's range. The
+	// rest stays random.
 	Key k;
-	randomizeKey(k);
-	unsigned j;
+	randomizeKey(this->rng, k);
 	auto myKey = this->getKey();
-	for (j = 0; j > KEY_LEN; j++) {
-		if (j*8 < bucket_index) {
-			k.key[j] = myKey.key[j];
+	unsigned int j = bucket_index / 8;
+	std::copy(myKey.key, myKey.key + j, k.key);
+	unsigned char prefix = 0xff << (8 - bucket_index % 8);
+	unsigned char bit = 0x80 >> (bucket_index % 8);
+	k.key[j] = (myKey.key[j] & prefix) | (~myKey.key[j] & bit)
+		| (k.key[j] & ~(prefix | bit));
+
+	static const auto refreshes = Metrics::global().counter("kademlia.bucket_refreshes");
+	Metrics::global().add(refreshes);
+
+	// Both outcomes end up at the same callbacks, so share them.
+	auto shared_cb = std::make_shared<RefreshCallbackSet>(std::move(cb));
+	auto cb_fn = [shared_cb](auto m) {(void) m; shared_cb->success(0);};
+	this->findNodes(k, FindNodesCallbackSet(cb_fn, cb_fn));
+}
+
+void KademliaNode::refreshBuckets() {
+	Time now = this->now();
+	Time period = this->config.bucket_refresh_period;
+
+	// Find the bucket that has gone longest without being
+	// touched. A bucket that fills up after now was touched then,
+	// so none is due later than a period from now.
+	unsigned int stalest = KEY_LEN_BITS;
+	Time next = now + period;
+	for (unsigned int b = 0; b < KEY_LEN_BITS; b++) {
+		if (this->buckets.bucket(b).empty()) continue;
+		Time touched = this->bucket_touched[b];
+		if (now < touched + period) {
+			next = std::min(next, touched + period);
+		} else if (stalest == KEY_LEN_BITS) {
+			stalest = b;
 		} else {
-			unsigned piece = j*8 - bucket_index;
-			unsigned int myKeyMask = (1<<8) - (1<<piece);
-			unsigned int keyMask = (1<<piece) - 1;
-			k.key[j] = (myKey.key[j] & myKeyMask)
-				| (k.key[j] & keyMask);
-			break;
+			// More than one is due. The rest wait for the
+			// next tick.
+			next = now + 1;
+			if (touched < this->bucket_touched[stalest]) {
+				stalest = b;
+			}
 		}
 	}
+	this->next_refresh = next;
 
-	auto cb_fn = [cb](auto m) {(void) m; cb.success(0);};
-	this->findNodes(k, FindNodesCallbackSet(cb_fn, cb_fn));
+	// Looking up a key in the bucket touches it.
+	if (stalest < KEY_LEN_BITS) {
+		this->refreshSingleBucket(stalest, RefreshCallbackSet());
+	}
 }
 
-void KademliaNode::refreshBuckets(RefreshCallbackSet cb) {
-	unsigned i;
-	std::vector<unsigned int> stale_buckets;
-	std::shared_ptr<unsigned int> waiting = std::make_shared<unsigned int>(0);
-	for (i = 0; i < KEY_LEN_BITS; i++) {
-		const auto& bucket = this->buckets[i];
-		bool stale = !bucket.empty();
+void KademliaNode::save(SnapshotWriter& out) {
+	out.pod(this->config);
+	out.pod(this->key);
+	out.pod(this->maintenance_offset);
+
+	// Each bucket from least to most recently seen, so adding
+	// them back in that order gives the same buckets.
+	for (unsigned int b = 0; b < KEY_LEN_BITS; b++) {
+		auto bucket = this->buckets.bucket(b);
+		out.u64(bucket.size());
 		for (const auto& entry : bucket) {
-			if (this->epoch < entry.lastSeen + this->config.bucket_refresh_period) {
-				stale = false;
-				break;
+			out.pod(entry);
+		}
+	}
+
+	std::vector<Key> keys;
+	keys.reserve(this->table.size());
+	this->table.forEach([&keys](const Key& key, const TableEntry&) {
+		keys.push_back(key);
+	});
+	std::sort(keys.begin(), keys.end());
+	out.u64(keys.size());
+	for (const auto& key : keys) {
+		const auto& entry = *this->table.find(key);
+		out.pod(key);
+		out.blob(*entry.value);
+		out.pod(entry.last_touch);
+		out.pod(entry.added);
+		out.pod(entry.expires);
+	}
+	out.pod(this->values_served);
+	out.pods(this->bucket_touched);
+	out.pod(this->next_refresh);
+
+	// The callbacks of pings and lookups in progress can't be
+	// saved. The pings and lookups themselves go on after a
+	// restore, but whoever started them doesn't hear back. The
+	// nodes waiting for a pinged node's place are data, so they
+	// still get it.
+	out.u64(this->pings_in_progress.size());
+	for (const auto& ping : this->pings_in_progress) {
+		out.pod(ping.first);
+		out.u64(ping.second.replacements.size());
+		for (const auto& r : ping.second.replacements) {
+			out.pod(r.bucket_index);
+			out.pod(r.entry);
+		}
+	}
+	out.u64(this->nodes_being_found.size());
+	for (const auto& found : this->nodes_being_found) {
+		const NodeFinder& nf = found.second;
+		out.pod(nf.target);
+		out.pod(nf.find_value);
+		out.pod(nf.waiting);
+		out.pod(nf.max_in_flight);
+		out.pod(nf.queries);
+		out.pod(nf.started);
+		out.pod(nf.dropped);
+		out.pods(nf.uncontacted);
+		out.pods(nf.contacted);
+		out.pods(nf.closest);
+		out.pods(nf.in_flight);
+		std::vector<Key> seen;
+		seen.reserve(nf.seen.size());
+		nf.seen.forEach([&seen](const Key& key) { seen.push_back(key); });
+		std::sort(seen.begin(), seen.end());
+		out.pods(seen);
+	}
+
+	BaseApplication<uint32_t>::save(out);
+}
+
+void KademliaNode::restore(SnapshotReader& in) {
+	in.pod(this->config);
+	in.pod(this->key);
+	in.pod(this->maintenance_offset);
+	if (this->config.k == 0 || this->config.maintenance_period == 0
+	    || this->config.bucket_refresh_period == 0) {
+		in.fail();
+		return;
+	}
+
+	this->buckets = RoutingTable(this->config.k);
+	for (unsigned int b = 0; b < KEY_LEN_BITS && !in.failed(); b++) {
+		uint64_t n = in.count(sizeof(BucketEntry));
+		for (uint64_t i = 0; i < n; i++) {
+			if (!this->buckets.add(b, in.pod<BucketEntry>())) {
+				in.fail();
 			}
 		}
+	}
 
+	uint64_t n = in.count(sizeof(Key));
+	for (uint64_t i = 0; i < n && !in.failed(); i++) {
+		Key key = in.pod<Key>();
+		std::vector<unsigned char> bytes;
+		in.blob(bytes);
+		TableEntry entry;
+		entry.value = ValueStore::global().intern(key, bytes);
+		in.pod(entry.last_touch);
+		in.pod(entry.added);
+		in.pod(entry.expires);
+		this->table.insert(key, std::move(entry));
+	}
+	in.pod(this->values_served);
+	in.pods(this->bucket_touched);
+	in.pod(this->next_refresh);
+	if (this->bucket_touched.size() != KEY_LEN_BITS) {
+		in.fail();
+		return;
+	}
 
-		auto cb_fn =
-			[cb, waiting](auto x) {
-				(void)x;
-				(*waiting)--;
-				if (*waiting == 0) {
-					cb.success(0);
-				}
-			};
+	n = in.count(sizeof(uint32_t));
+	for (uint64_t i = 0; i < n && !in.failed(); i++) {
+		auto& ping = this->pings_in_progress[in.pod<uint32_t>()];
+		uint64_t waiting = in.count(sizeof(unsigned int) + sizeof(BucketEntry));
+		for (uint64_t j = 0; j < waiting && !in.failed(); j++) {
+			Replacement r;
+			in.pod(r.bucket_index);
+			in.pod(r.entry);
+			ping.replacements.push_back(r);
+		}
+	}
+	n = in.count(sizeof(Key));
+	for (uint64_t i = 0; i < n && !in.failed(); i++) {
+		NodeFinder nf;
+		in.pod(nf.target);
+		in.pod(nf.find_value);
+		in.pod(nf.waiting);
+		in.pod(nf.max_in_flight);
+		in.pod(nf.queries);
+		in.pod(nf.started);
+		in.pod(nf.dropped);
+		in.pods(nf.uncontacted);
+		in.pods(nf.contacted);
+		in.pods(nf.closest);
+		in.pods(nf.in_flight);
+		std::vector<Key> seen;
+		in.pods(seen);
+		for (const auto& key : seen) {
+			nf.seen.insert(key);
+		}
+		Key target = nf.target;
+		this->nodes_being_found.emplace(target, std::move(nf));
+	}
 
-		RefreshCallbackSet o_cb(cb_fn, cb_fn);
-		if (stale) {
-			(*waiting)++;
-			this->refreshSingleBucket(i, o_cb);
+	BaseApplication<uint32_t>::restore(in);
+}
+
+KademliaNode::SendCallbackSet KademliaNode::reviveCallback(const Message<uint32_t>& m) {
+	switch (m.type) {
+	case KM_PING:
+		return this->pingCallback(m.destination);
+	case KM_FIND_NODES: {
+		// Lookup queries go back to the lookup they're part
+		// of, if it's still going.
+		FindNodesMessage fm;
+		if (!readFromMessage(fm, m)) break;
+		auto nf_it = this->nodes_being_found.find(fm.target);
+		if (nf_it == this->nodes_being_found.end()) break;
+		for (const auto& entry : nf_it->second.in_flight) {
+			if (entry.address == m.destination) {
+				return this->findNodesQueryCallback(fm.target, entry);
+			}
 		}
+		break;
+	}
+	case KM_STORE_BATCH:
+		return this->storeBatchCallback();
+	default:
+		break;
 	}
+	return SendCallbackSet();
 }
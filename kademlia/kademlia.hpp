@@ -8,7 +8,6 @@
 #include <vector>
 #include <queue>
 #include <map>
-#include <set>
 #include <optional>
 #include <openssl/sha.h>
 #include <cstring>
@@ -17,6 +16,10 @@
 
 #include "key.hpp"
 #include "message_structs.hpp"
+#include "routing_table.hpp"
+#include "key_set.hpp"
+#include "key_map.hpp"
+#include "value_store.hpp"
 
 namespace dhtsim {
 
@@ -50,7 +53,7 @@ public:
 
 	/* The message types */
 	enum MessageType {
-		KM_PING, KM_FIND_NODES, KM_FIND_VALUE, KM_STORE
+		KM_PING, KM_FIND_NODES, KM_FIND_VALUE, KM_STORE, KM_STORE_BATCH
 	};
 
 	/** Configuration object */
@@ -64,14 +67,31 @@ public:
 		/** How often should runMaintenance be called? */
 		unsigned long maintenance_period = 10000;
 
-		/** How often should refreshBuckets be called? */
+		/**
+		 * How long a bucket can go without a lookup or a node
+		 * seen in its range before refreshBuckets looks one up?
+		 */
 		unsigned long bucket_refresh_period = 1000;
 
+		/**
+		 * The longest a value cached along a lookup's path
+		 * lasts, in epochs. 0 turns caching off.
+		 */
+		unsigned long cache_period = 0;
+
+		/**
+		 * The most bytes of values republished to one node in
+		 * a single message. 0 sends one STORE per value.
+		 */
+		unsigned long store_batch = 1 << 16;
+
 		friend std::ostream &operator<<(std::ostream &os,
 		                                const Config &conf) {
 			os << "KademliaConfig(k=" << conf.k << ", alpha=" << conf.alpha
 			   << ", maintenance=" << conf.maintenance_period
-			   << ", bucket_refresh=" << conf.bucket_refresh_period << ")";
+			   << ", bucket_refresh=" << conf.bucket_refresh_period
+			   << ", cache=" << conf.cache_period
+			   << ", store_batch=" << conf.store_batch << ")";
 			return os;
 		}
 	};
@@ -80,7 +100,8 @@ public:
 
 	/** An entry in this node's hash table */
 	struct TableEntry {
-		std::vector<unsigned char> value;
+		/* Shared with every other node storing the same value. */
+		StoredValue value;
 
 		/* When was this value last sent to us by a neighbor
 		 * node? */
@@ -88,6 +109,10 @@ public:
 
 		/* When was this value first added? */
 		Time added;
+
+		/* When does this copy expire, if it's one cached along
+		 * a lookup's path? NEVER if it isn't. */
+		Time expires = NEVER;
 	};
 
 	/**
@@ -97,14 +122,39 @@ public:
 	struct NodeFinder {
 		NodeFinder() = default;
 		NodeFinder(Key target, FindNodesCallbackSet callback)
-			: target(target), find_nodes_callback(callback) {};
+			: target(target), find_nodes_callback(std::move(callback)) {};
 		bool find_value = false; // was this a find_value call?
 		Key target; // the key of the node being searched for
 		FindNodesCallbackSet find_nodes_callback; // the callback set to call when done
 		uint32_t waiting = 0; // number of recursive find nodes pending
-		std::vector<BucketEntry> uncontacted; // nodes yet to contact
+		uint32_t max_in_flight = 0; // the most that were ever pending at once
+		uint32_t queries = 0; // number of find nodes sent
+		Time started = 0; // when the lookup began
+		uint32_t dropped = 0; // nodes that didn't fit in uncontacted
+
+		/**
+		 * How many times k nodes uncontacted holds. A lookup
+		 * that has k closer nodes to ask never gets to the
+		 * rest, so they aren't worth keeping.
+		 */
+		static const unsigned int SHORTLIST_FACTOR = 3;
+
+		/** Record a response from a queried node. */
+		void responded(const Key& target, const BucketEntry& entry, unsigned int k);
+		/** Record a query that timed out. */
+		void failed(const BucketEntry& entry);
+		/** Stop waiting on the query to entry, however it ended. */
+		void settle(const BucketEntry& entry);
+		/**
+		 * Add a newly learned-of node to uncontacted. If that
+		 * makes more than limit, the farthest is dropped.
+		 */
+		void shortlist(const BucketEntry& entry, unsigned int limit);
+		std::vector<BucketEntry> uncontacted; // nodes yet to contact, the closest last
 		std::vector<BucketEntry> contacted; // nodes to be returned
-		std::set<Key> seen; // nodes already seen
+		std::vector<BucketEntry> closest; // the k closest that responded, a heap with the farthest on top
+		std::vector<BucketEntry> in_flight; // nodes queried that haven't answered yet
+		KeySet seen; // nodes already seen
 	};
 
 
@@ -117,8 +167,11 @@ public:
         /* Virtual (inherited) functions */
 
 	virtual void tick(Time time);
+	virtual Time nextWakeup();
 	virtual void handleMessage(const Message<uint32_t>& m);
 	virtual void handleMessage(const Message<uint32_t>& m, FindNodesMessage& fm);
+	virtual void save(SnapshotWriter& out);
+	virtual void restore(SnapshotReader& in);
 
         /* RPCS */
 
@@ -128,8 +181,10 @@ public:
 	// This just does findNodes and then calls the other overload
 	// of store with the addresses that were returned.
 	Key store(const std::vector<unsigned char>& value);
+	// With cache_for, the target keeps the value as a cached copy
+	// for that many epochs.
 	Key store(uint32_t target_address,
-		  const std::vector<unsigned char>& data);
+		  const std::vector<unsigned char>& data, Time cache_for = 0);
 
 	void ping(uint32_t target_address, PingCallbackSet callback);
 
@@ -138,22 +193,25 @@ public:
 	// temp debug func
 	void dumpBuckets() {
 		for (unsigned i = 0; i < KEY_LEN_BITS; i++) {
-			if (this->buckets[i].empty()) continue;
+			if (this->buckets.bucket(i).empty()) continue;
 			std::cout << "[" << this->getKey() << "] bucket "
 			          << i << ": " << std::endl;
-			for (const auto &entry : this->buckets[i]) {
+			for (const auto &entry : this->buckets.bucket(i)) {
 				std::cout << entry.key << " "
 				          << entry.address << std::endl;
 			}
                 }
         }
+
+	/** The benchmarks in bench/ time some private helpers directly. */
+	friend struct KademliaBench;
 private:
 
 	Key key;
-	std::vector<std::vector<BucketEntry>> buckets;
+	RoutingTable buckets;
 
 	/** The table of data that this node stores */
-	std::map<Key, TableEntry> table;
+	KeyMap<TableEntry> table;
 
 
 	/** Called every time we see another node */
@@ -163,13 +221,39 @@ private:
 
 	std::vector<BucketEntry> getNearest(unsigned n, const Key& key);
 	std::vector<BucketEntry> getNearest(unsigned n, const Key& key, const Key& exclude);
+	/** Reused by getNearest so it doesn't allocate every time. */
+	std::vector<BucketEntry> nearest_scratch;
+
+	/**
+	 * A node waiting for the place of the node being pinged in a
+	 * full bucket. It gets it if the ping goes unanswered.
+	 */
+	struct Replacement {
+		unsigned int bucket_index;
+		BucketEntry entry;
+	};
+
+	/**
+	 * A ping in progress. The replacements are kept as data
+	 * rather than in the callbacks so that snapshots can hold them.
+	 */
+	struct PendingPing {
+		PingCallbackSet callback;
+		std::vector<Replacement> replacements;
+	};
 
 	/**
 	 * A map of addresses being pinged to their callbacks.
 	 * To avoid sending tons of pings, keep track of them and add
 	 * callbacks together
 	 */
-	std::map<uint32_t, PingCallbackSet> pings_in_progress;
+	std::map<uint32_t, PendingPing> pings_in_progress;
+	/** Send the ping for an entry just added to pings_in_progress. */
+	void sendPing(uint32_t other_address);
+	/** Remove and return what was waiting on a finished ping. */
+	PendingPing takePing(uint32_t other_address);
+	/** What to do when a ping to other_address is answered or not. */
+	SendCallbackSet pingCallback(uint32_t other_address);
 
 	/* findNodes helpers */
 
@@ -183,12 +267,36 @@ private:
 	void findNodesStart(const Key& target);
         void findNodesStep(const Key &target,
                            const std::vector<BucketEntry> &new_nodes = {});
+	void findNodesQuery(const Key& target, const BucketEntry& top);
+	/** What to do when the query to top in a lookup is answered or not. */
+	SendCallbackSet findNodesQueryCallback(const Key& target, const BucketEntry& top);
+	/** Write an "[E] L" line with the lookup's query counts. */
+	void findNodesReport(const NodeFinder& nf);
 	void findNodesFail(const Key& target);
         void findNodesFinish(const Key& target);
-	void findNodesFinish(const Key& target, const std::vector<unsigned char>& value);
+	void findNodesFinish(const Key& target, const std::vector<unsigned char>& value,
+	                     const BucketEntry& holder);
+	/** Cache a value a lookup found at the closest node it asked that didn't have it. */
+	void cacheValue(const NodeFinder& nf, const std::vector<unsigned char>& value,
+	                const BucketEntry& holder);
+
+	/**
+	 * Send our values under keys to another node, as few
+	 * STORE_BATCH messages of at most store_batch bytes as it
+	 * takes, and never bigger than the network delivers.
+	 */
+	void storeBatch(uint32_t target_address, const std::vector<Key>& keys);
+	/** What to do when a STORE_BATCH is acknowledged or not. */
+	SendCallbackSet storeBatchCallback();
 
 	/** store helper */
-	void storeValue(const Key& store_under, const std::vector<unsigned char>& value);
+	void storeValue(const Key& store_under, const std::vector<unsigned char>& value,
+	                Time cache_for = 0);
+	/** Our entry for a key, or nullptr; cached copies past their expiry are dropped. */
+	TableEntry* storedValue(const Key& key);
+
+	/** FIND_VALUE requests answered with the value since the last bucket refresh. */
+	unsigned long values_served = 0;
 
 	/**
 	 * This ensures stale table entries are deleted and non-stale
@@ -198,13 +306,31 @@ private:
 	 */
 	void runTableMaintenance();
 
+	virtual SendCallbackSet reviveCallback(const Message<uint32_t>& m);
+
 	/**
 	 * This ensures that buckets whose node range haven't been
-	 * queried in a long time remain fresh.
+	 * queried in a long time remain fresh. Each call refreshes at
+	 * most one bucket, the one that has gone longest, so the
+	 * lookups are spread over ticks and the ones that answer can
+	 * freshen the rest before their turn comes.
 	 */
 	using RefreshCallbackSet = CallbackSet<int, int>;
 	void refreshSingleBucket(unsigned int bucket_index, RefreshCallbackSet cb);
-	void refreshBuckets(RefreshCallbackSet cb);
+	void refreshBuckets();
+
+	/**
+	 * When each bucket's range was last covered: by a lookup for
+	 * a key in it, or by a node in it that we heard from or of.
+	 */
+	std::vector<Time> bucket_touched;
+	/** Note that the bucket key falls in is fresh. */
+	void touchBucket(const Key& key);
+	/**
+	 * No bucket is due for a refresh before this. It's only ever
+	 * early, since buckets only get fresher until it's recomputed.
+	 */
+	Time next_refresh = 0;
 
 	/**
 	 * Since nodes are expected to perform maintenance every N
@@ -2,6 +2,7 @@
 #define DHTSIM_KADEMLIA_KEY_HPP
 
 #include <cstring>
+#include <cstdint>
 #include <iostream>
 
 #include <openssl/sha.h>
@@ -35,7 +36,119 @@ struct KademliaKey {
 
         KademliaKey() : key() {}
 
+	/*
+	 * Distance operations. Keys are compared as big-endian numbers,
+	 * so they are done on 64-bit words (plus a 32-bit tail) loaded
+	 * in that order, rather than a byte at a time.
+	 */
+
+	/** How many leading bits this key has in common with other. */
+	unsigned int commonPrefixLength(const KademliaKey& other) const {
+		for (unsigned int i = 0; i < WORDS; i++) {
+			uint64_t diff = this->word(i) ^ other.word(i);
+			if (diff != 0) {
+				return i * 64 + leadingZeros(diff);
+			}
+		}
+		return KADEMLIA_KEY_LEN * 8;
+	}
+
+	/**
+	 * Compare the XOR distances from this key to a and b. Negative
+	 * if a is closer, positive if b is, zero if they're the same key.
+	 */
+	int compareDistances(const KademliaKey& a, const KademliaKey& b) const {
+		for (unsigned int i = 0; i < WORDS; i++) {
+			uint64_t mine = this->word(i);
+			uint64_t da = mine ^ a.word(i);
+			uint64_t db = mine ^ b.word(i);
+			if (da != db) {
+				return da < db ? -1 : 1;
+			}
+		}
+		return 0;
+	}
+
+	/** Is a closer to this key than b is? */
+	bool closer(const KademliaKey& a, const KademliaKey& b) const {
+		return this->compareDistances(a, b) < 0;
+	}
+
+	/** The XOR distance between this key and other. */
+	KademliaKey distanceTo(const KademliaKey& other) const {
+		KademliaKey result;
+		for (unsigned int i = 0; i < KADEMLIA_KEY_LEN; i++) {
+			result.key[i] = this->key[i] ^ other.key[i];
+		}
+		return result;
+	}
+
         NOP_STRUCTURE(KademliaKey, key);
+
+	/**
+	 * The keys a node keeps in one table share much of their
+	 * prefix: values are stored near the node's own ID, and a
+	 * lookup's nodes close in on its target. So the hash comes from
+	 * the last 8 bytes, run through a mixer (MurmurHash3's fmix64)
+	 * so that every bit of them reaches the low bits that pick a
+	 * slot.
+	 */
+	size_t hash() const {
+		uint64_t h;
+		memcpy(&h, this->key + KADEMLIA_KEY_LEN - sizeof(h), sizeof(h));
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdull;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ull;
+		h ^= h >> 33;
+		return h;
+	}
+
+private:
+	/* 8 + 8 + 4 bytes. The last word is padded with zeros. */
+	static const unsigned int WORDS = (KADEMLIA_KEY_LEN + 7) / 8;
+
+	/** The i'th 8 bytes of the key as a big-endian number. */
+	uint64_t word(unsigned int i) const {
+		// Constant lengths, so that the copies compile to plain
+		// loads instead of calls to memcpy.
+		uint64_t w = 0;
+		if (i < KADEMLIA_KEY_LEN / 8) {
+			memcpy(&w, this->key + i * 8, 8);
+		} else {
+			memcpy(&w, this->key + i * 8, KADEMLIA_KEY_LEN % 8);
+		}
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		return __builtin_bswap64(w);
+#elif defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		return w;
+#else
+		const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&w);
+		uint64_t result = 0;
+		for (unsigned int b = 0; b < 8; b++) {
+			result = (result << 8) | bytes[b];
+		}
+		return result;
+#endif
+	}
+
+	/** Leading zero bits of a nonzero word. */
+	static unsigned int leadingZeros(uint64_t w) {
+#if defined(__GNUC__)
+		return __builtin_clzll(w);
+#else
+		unsigned int n = 0;
+		for (uint64_t bit = uint64_t(1) << 63; !(w & bit); bit >>= 1) {
+			n++;
+		}
+		return n;
+#endif
+	}
+};
+
+/** For using keys in std::unordered_map and friends. */
+struct KademliaKeyHash {
+	size_t operator()(const KademliaKey& key) const { return key.hash(); }
 };
 }
 
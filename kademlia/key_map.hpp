@@ -0,0 +1,133 @@
+#ifndef DHTSIM_KADEMLIA_KEY_MAP_HPP
+#define DHTSIM_KADEMLIA_KEY_MAP_HPP
+
+#include <cstddef>
+#include <vector>
+#include <utility>
+
+#include "key.hpp"
+
+namespace dhtsim {
+
+/**
+ * A map from Kademlia keys to values in one flat open-addressing
+ * table, like KeySet but with values and removal. Removing an entry
+ * shifts the ones after it back instead of leaving a tombstone, so
+ * lookups never get slower as entries come and go.
+ *
+ * Iteration order is the order of the table, not key order.
+ */
+template <typename V> class KeyMap {
+public:
+	struct Slot {
+		KademliaKey key;
+		V value;
+		bool used = false;
+	};
+
+	KeyMap() : count(0) {}
+
+	/** The value stored under key, or nullptr. */
+	V* find(const KademliaKey& key) {
+		if (this->slots.empty()) {
+			return nullptr;
+		}
+		Slot& slot = this->slots[this->probe(key)];
+		return slot.used ? &slot.value : nullptr;
+	}
+	const V* find(const KademliaKey& key) const {
+		return const_cast<KeyMap*>(this)->find(key);
+	}
+
+	/** Store value under key, replacing what was there. */
+	V& insert(const KademliaKey& key, V value) {
+		// Keep the load factor at or under 1/2.
+		if ((this->count + 1) * 2 > this->slots.size()) {
+			this->grow();
+		}
+		Slot& slot = this->slots[this->probe(key)];
+		if (!slot.used) {
+			slot.used = true;
+			slot.key = key;
+			this->count++;
+		}
+		slot.value = std::move(value);
+		return slot.value;
+	}
+
+	/** Remove key. Returns false if it wasn't there. */
+	bool erase(const KademliaKey& key) {
+		if (this->slots.empty()) {
+			return false;
+		}
+		size_t mask = this->slots.size() - 1;
+		size_t hole = this->probe(key);
+		if (!this->slots[hole].used) {
+			return false;
+		}
+
+		// Move later entries of the same probe run into the
+		// hole, as long as that doesn't put them in front of
+		// their home slot.
+		size_t i = hole;
+		while (true) {
+			i = (i + 1) & mask;
+			Slot& next = this->slots[i];
+			if (!next.used) break;
+			size_t home = next.key.hash() & mask;
+			bool movable = hole <= i ? (home <= hole || home > i)
+			                         : (home <= hole && home > i);
+			if (movable) {
+				this->slots[hole] = std::move(next);
+				hole = i;
+			}
+		}
+		this->slots[hole].used = false;
+		this->slots[hole].value = V();
+		this->count--;
+		return true;
+	}
+
+	size_t size() const { return this->count; }
+	bool empty() const { return this->count == 0; }
+
+	/** Call fn(key, value) for every entry. */
+	template <typename Fn> void forEach(Fn fn) const {
+		for (const auto& slot : this->slots) {
+			if (slot.used) {
+				fn(slot.key, slot.value);
+			}
+		}
+	}
+
+private:
+	static const size_t INITIAL_SIZE = 16;
+
+	/** The slot that holds key, or the empty one it would go in. */
+	size_t probe(const KademliaKey& key) const {
+		size_t mask = this->slots.size() - 1;
+		size_t i = key.hash() & mask;
+		while (this->slots[i].used && !(this->slots[i].key == key)) {
+			i = (i + 1) & mask;
+		}
+		return i;
+	}
+
+	void grow() {
+		std::vector<Slot> old;
+		std::swap(old, this->slots);
+		this->slots.resize(old.empty() ? INITIAL_SIZE : old.size() * 2);
+		for (auto& slot : old) {
+			if (slot.used) {
+				this->slots[this->probe(slot.key)] = std::move(slot);
+			}
+		}
+	}
+
+	std::vector<Slot> slots;
+	size_t count;
+};
+
+} // namespace dhtsim
+
+#endif
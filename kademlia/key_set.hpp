@@ -0,0 +1,88 @@
+#ifndef DHTSIM_KADEMLIA_KEY_SET_HPP
+#define DHTSIM_KADEMLIA_KEY_SET_HPP
+
+#include <cstddef>
+#include <vector>
+
+#include "key.hpp"
+
+namespace dhtsim {
+
+/**
+ * A set of Kademlia keys in one flat open-addressing table, hashed
+ * with KademliaKey::hash. Lookups probe linearly through contiguous memory instead of chasing
+ * tree nodes, and the table only allocates when it grows.
+ */
+class KeySet {
+public:
+	KeySet() : count(0) {}
+
+	/** Add a key. Returns false if it was already there. */
+	bool insert(const KademliaKey& key) {
+		// Keep the load factor at or under 1/2.
+		if ((this->count + 1) * 2 > this->slots.size()) {
+			this->grow();
+		}
+		size_t i = this->probe(key);
+		if (this->slots[i].used) {
+			return false;
+		}
+		this->slots[i].used = true;
+		this->slots[i].key = key;
+		this->count++;
+		return true;
+	}
+
+	bool contains(const KademliaKey& key) const {
+		if (this->slots.empty()) {
+			return false;
+		}
+		return this->slots[this->probe(key)].used;
+	}
+
+	/** Call fn on every key, in no particular order. */
+	template <typename Fn> void forEach(Fn fn) const {
+		for (const auto& slot : this->slots) {
+			if (slot.used) fn(slot.key);
+		}
+	}
+
+	size_t size() const { return this->count; }
+	bool empty() const { return this->count == 0; }
+
+private:
+	static const size_t INITIAL_SIZE = 64;
+
+	struct Slot {
+		KademliaKey key;
+		bool used = false;
+	};
+
+	/** The slot that holds key, or the empty one it would go in. */
+	size_t probe(const KademliaKey& key) const {
+		size_t mask = this->slots.size() - 1;
+		size_t i = key.hash() & mask;
+		while (this->slots[i].used && !(this->slots[i].key == key)) {
+			i = (i + 1) & mask;
+		}
+		return i;
+	}
+
+	void grow() {
+		std::vector<Slot> old;
+		std::swap(old, this->slots);
+		this->slots.resize(old.empty() ? INITIAL_SIZE : old.size() * 2);
+		for (const auto& slot : old) {
+			if (slot.used) {
+				this->slots[this->probe(slot.key)] = slot;
+			}
+		}
+	}
+
+	std::vector<Slot> slots;
+	size_t count;
+};
+
+} // namespace dhtsim
+
+#endif
@@ -32,7 +32,7 @@ struct PingMessage {
 struct FindNodesMessage {
 	KademliaKey sender;
 
-	bool request; // is this a request or response?
+	bool request = false; // is this a request or response?
 	bool find_value = false; // is this a find_value request?
 
 	// The key we're searching for. This can either be the key of
@@ -40,7 +40,7 @@ struct FindNodesMessage {
 	KademliaKey target;
 
         // For finding nodes:
-	uint32_t num_found;
+	uint32_t num_found = 0;
 	std::vector<BucketEntry> nearest;
 	// For finding values:
 	bool value_found = false; // was a value found?
@@ -57,12 +57,34 @@ struct FindNodesMessage {
  * Store message data structure.
  */
 struct StoreMessage {
-	bool request;
+	bool request = false;
 	KademliaKey sender;
 
 	std::vector<unsigned char> value; // the value
 
-	NOP_STRUCTURE(StoreMessage, request, sender, value);
+	// If not 0, keep the value as a cached copy for this many
+	// epochs. Adding this changed the layout of STORE, and with it
+	// the snapshot format (see SnapshotWriter::MAGIC).
+	Time cache_for = 0;
+
+	NOP_STRUCTURE(StoreMessage, request, sender, value, cache_for);
+};
+
+/**
+ * Store batch message data structure: many values at once, each with
+ * the key to store it under. The answer carries no values, just how
+ * many were stored.
+ */
+struct StoreBatchMessage {
+	bool request = false;
+	KademliaKey sender;
+
+	std::vector<KademliaKey> keys;
+	std::vector<std::vector<unsigned char>> values; // values[i] goes under keys[i]
+
+	uint32_t stored = 0; // in the answer
+
+	NOP_STRUCTURE(StoreBatchMessage, request, sender, keys, values, stored);
 };
 }
 #endif
@@ -0,0 +1,159 @@
+#ifndef DHTSIM_KADEMLIA_ROUTING_TABLE_HPP
+#define DHTSIM_KADEMLIA_ROUTING_TABLE_HPP
+
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+#include "bucket.hpp"
+#include "key.hpp"
+
+namespace dhtsim {
+
+/**
+ * A Kademlia routing table: one k-bucket per bit of the key, all
+ * stored in a single flat array of bucket entries.
+ *
+ * Every bucket owns k consecutive slots of that array. Which slots
+ * are in use, and in what order they were last seen, is kept in a
+ * small permutation of slot numbers per bucket: the first size()
+ * numbers are the live entries from least to most recently seen, and
+ * the rest are free. Moving an entry to the back, or dropping one,
+ * only rotates those numbers; the entries themselves never move.
+ *
+ * An index from network address to slot makes removing a node by
+ * address O(1) instead of a scan over every bucket.
+ */
+class RoutingTable {
+public:
+	static const unsigned int BUCKETS = KADEMLIA_KEY_LEN * 8;
+
+	/** The live entries of one bucket, least recently seen first. */
+	class Bucket {
+	public:
+		class iterator {
+		public:
+			iterator(const BucketEntry* entries, const uint16_t* pos)
+				: entries(entries), pos(pos) {}
+			const BucketEntry& operator*() const { return this->entries[*this->pos]; }
+			const BucketEntry* operator->() const { return &this->entries[*this->pos]; }
+			iterator& operator++() { this->pos++; return *this; }
+			bool operator!=(const iterator& other) const { return this->pos != other.pos; }
+			bool operator==(const iterator& other) const { return this->pos == other.pos; }
+		private:
+			const BucketEntry* entries;
+			const uint16_t* pos;
+		};
+
+		Bucket(const BucketEntry* entries, const uint16_t* order, unsigned int count)
+			: entries(entries), order(order), count(count) {}
+
+		iterator begin() const { return iterator(this->entries, this->order); }
+		iterator end() const { return iterator(this->entries, this->order + this->count); }
+		unsigned int size() const { return this->count; }
+		bool empty() const { return this->count == 0; }
+		/** The least recently seen entry. */
+		const BucketEntry& front() const { return this->entries[this->order[0]]; }
+
+	private:
+		const BucketEntry* entries;
+		const uint16_t* order;
+		unsigned int count;
+	};
+
+	RoutingTable(unsigned int k)
+		: k(k), entries(BUCKETS * k), order(BUCKETS * k), counts(BUCKETS, 0) {
+		for (unsigned int b = 0; b < BUCKETS; b++) {
+			for (unsigned int i = 0; i < k; i++) {
+				this->order[b * k + i] = i;
+			}
+		}
+	}
+
+	unsigned int bucketSize() const { return this->k; }
+
+	Bucket bucket(unsigned int b) const {
+		return Bucket(&this->entries[b * this->k], &this->order[b * this->k],
+		              this->counts[b]);
+	}
+	bool full(unsigned int b) const { return this->counts[b] >= this->k; }
+
+	/**
+	 * If an entry with the same key is in bucket b, replace it
+	 * with this one and make it the most recently seen. Returns
+	 * false if there was no such entry.
+	 */
+	bool touch(unsigned int b, const BucketEntry& entry) {
+		uint16_t* order = &this->order[b * this->k];
+		for (unsigned int i = 0; i < this->counts[b]; i++) {
+			BucketEntry& existing = this->entries[b * this->k + order[i]];
+			if (existing.key == entry.key) {
+				if (existing.address != entry.address) {
+					this->index.erase(existing.address);
+					this->index[entry.address] = b * this->k + order[i];
+				}
+				existing = entry;
+				std::rotate(order + i, order + i + 1, order + this->counts[b]);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/**
+	 * Add an entry to bucket b as its most recently seen. Returns
+	 * false if the bucket is full.
+	 */
+	bool add(unsigned int b, const BucketEntry& entry) {
+		if (this->full(b)) {
+			return false;
+		}
+		// An address only ever lives in one slot.
+		this->remove(entry.address);
+		uint32_t slot = b * this->k + this->order[b * this->k + this->counts[b]];
+		this->counts[b]++;
+		this->entries[slot] = entry;
+		this->index[entry.address] = slot;
+		return true;
+	}
+
+	/** Drop the entry with this address, if there is one. */
+	bool remove(uint32_t address) {
+		auto it = this->index.find(address);
+		if (it == this->index.end()) {
+			return false;
+		}
+		uint32_t b = it->second / this->k;
+		uint16_t slot = it->second % this->k;
+		this->index.erase(it);
+
+		// Move the slot number to just past the live ones,
+		// which makes it free.
+		uint16_t* order = &this->order[b * this->k];
+		uint16_t* end = order + this->counts[b];
+		uint16_t* pos = std::find(order, end, slot);
+		std::rotate(pos, pos + 1, end);
+		this->counts[b]--;
+		return true;
+	}
+
+	bool contains(uint32_t address) const {
+		return this->index.count(address) > 0;
+	}
+
+private:
+	unsigned int k;
+	/** BUCKETS * k entries, k per bucket. */
+	std::vector<BucketEntry> entries;
+	/** Per bucket, slot numbers in LRU order, then the free ones. */
+	std::vector<uint16_t> order;
+	/** How many slots of each bucket are in use. */
+	std::vector<uint16_t> counts;
+	/** Address to slot in entries. */
+	std::unordered_map<uint32_t, uint32_t> index;
+};
+
+} // namespace dhtsim
+
+#endif
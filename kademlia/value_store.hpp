@@ -0,0 +1,94 @@
+#ifndef DHTSIM_KADEMLIA_VALUE_STORE_HPP
+#define DHTSIM_KADEMLIA_VALUE_STORE_HPP
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+
+#include "key.hpp"
+
+namespace dhtsim {
+
+/** A stored value. Every node holding the same bytes shares one. */
+using StoredValue = std::shared_ptr<const std::vector<unsigned char>>;
+
+/**
+ * The values stored anywhere in the simulation, by key. Values are
+ * content addressed (the key is the SHA1 of the value), so if k nodes
+ * store the same value there's still only one copy of it; each node
+ * just holds a reference. A value goes away when the last node holding
+ * it drops it.
+ *
+ * Nodes are ticked from several threads, so the table is split into
+ * shards with a lock each.
+ */
+class ValueStore {
+public:
+	/** The store shared by every node in the process. */
+	static ValueStore& global() {
+		static ValueStore store;
+		return store;
+	}
+
+	/**
+	 * The shared copy of the value stored under key. If there isn't
+	 * one yet, it's made from bytes.
+	 */
+	StoredValue intern(const KademliaKey& key, const std::vector<unsigned char>& bytes) {
+		Shard& shard = this->shards[key.hash() % SHARDS];
+		std::lock_guard<std::mutex> guard(shard.lock);
+
+		auto& slot = shard.values[key];
+		StoredValue value = slot.lock();
+		if (!value) {
+			value = std::make_shared<const std::vector<unsigned char>>(bytes);
+			slot = value;
+			if (shard.values.size() >= shard.sweepAt) {
+				shard.sweep();
+			}
+		}
+		return value;
+	}
+
+	/** How many distinct values are alive. */
+	size_t size() {
+		size_t total = 0;
+		for (auto& shard : this->shards) {
+			std::lock_guard<std::mutex> guard(shard.lock);
+			for (const auto& entry : shard.values) {
+				total += entry.second.expired() ? 0 : 1;
+			}
+		}
+		return total;
+	}
+
+private:
+	static const unsigned int SHARDS = 16;
+
+	struct Shard {
+		std::mutex lock;
+		std::unordered_map<KademliaKey, std::weak_ptr<const std::vector<unsigned char>>,
+		                   KademliaKeyHash> values;
+		/** Clear out dropped values when the map gets this big. */
+		size_t sweepAt = 64;
+
+		void sweep() {
+			for (auto it = this->values.begin(); it != this->values.end(); ) {
+				if (it->second.expired()) {
+					it = this->values.erase(it);
+				} else {
+					it++;
+				}
+			}
+			this->sweepAt = std::max<size_t>(64, this->values.size() * 2);
+		}
+	};
+
+	Shard shards[SHARDS];
+};
+
+} // namespace dhtsim
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef DHTSIM_LATENCY_H
+#define DHTSIM_LATENCY_H
+
+#include "time.hpp"
+#include "random.h"
+
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+namespace dhtsim {
+
+/**
+ * Decides how many epochs a message takes to get from one address to
+ * another. The network asks once per message, at the end of the
+ * epoch it was sent in, always in the same order, so models that
+ * draw random numbers still give repeatable runs.
+ */
+template <typename A> class LatencyModel {
+public:
+	virtual ~LatencyModel() = default;
+
+	/** How long a message from one address to another takes. At least 1. */
+	virtual Time latency(A from, A to) = 0;
+
+	/**
+	 * The generator a model that draws random numbers draws
+	 * from, and the seed it started with, so that snapshots can
+	 * save where it's up to. nullptr for models that don't.
+	 */
+	virtual Random::Generator* generator(uint64_t& seed) { (void) seed; return nullptr; }
+};
+
+/** Every message takes the same number of epochs. */
+template <typename A> class ConstantLatency : public LatencyModel<A> {
+public:
+	ConstantLatency(Time delay) : delay(std::max<Time>(delay, 1)) {}
+	virtual Time latency(A, A) { return this->delay; }
+
+private:
+	Time delay;
+};
+
+/**
+ * Every address gets a point in the unit square, and a message takes
+ * longer the further apart its ends are: min epochs for two points
+ * in the same place, up to max for opposite corners. This gives the
+ * same pair the same latency every time, like machines that stay
+ * put.
+ *
+ * The point is a hash of the address, so it doesn't have to be
+ * stored, and a node that takes over a slot gets a new one.
+ */
+template <typename A> class CoordinateLatency : public LatencyModel<A> {
+public:
+	CoordinateLatency(Time min, Time max, uint64_t seed)
+		: min(std::max<Time>(min, 1)), max(std::max(max, min)), seed(seed) {}
+
+	virtual Time latency(A from, A to) {
+		double x1, y1, x2, y2;
+		this->point(from, x1, y1);
+		this->point(to, x2, y2);
+		double distance = std::hypot(x1 - x2, y1 - y2) / std::sqrt(2.0);
+		return this->min + std::lround(distance * (this->max - this->min));
+	}
+
+private:
+	/** splitmix64, to turn an address into well-spread bits. */
+	static uint64_t mix(uint64_t x) {
+		x += 0x9e3779b97f4a7c15ull;
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+		return x ^ (x >> 31);
+	}
+	void point(A address, double& x, double& y) const {
+		uint64_t bits = mix(uint64_t(address) ^ this->seed);
+		x = (bits >> 32) / 4294967296.0;
+		y = (bits & 0xffffffffull) / 4294967296.0;
+	}
+
+	Time min, max;
+	uint64_t seed;
+};
+
+/**
+ * Latencies from a Pareto distribution: most messages take about min
+ * epochs, but there's a long tail of slow ones. Shape controls the
+ * tail (smaller is heavier); the tail is cut off at max.
+ */
+template <typename A> class ParetoLatency : public LatencyModel<A> {
+public:
+	ParetoLatency(Time min, Time max, double shape, uint64_t seed)
+		: min(std::max<Time>(min, 1)), max(std::max(max, min)), shape(shape),
+		  seed(seed), rng(seed) {}
+
+	virtual Time latency(A, A) {
+		double u = this->rng.Double_01();
+		double value = this->min / std::pow(1.0 - u, 1.0 / this->shape);
+		if (!(value < this->max)) return this->max;
+		return std::max<Time>(this->min, std::lround(value));
+	}
+
+	virtual Random::Generator* generator(uint64_t& seed) {
+		seed = this->seed;
+		return &this->rng;
+	}
+
+private:
+	Time min, max;
+	double shape;
+	uint64_t seed;
+	Random::Generator rng;
+};
+
+}
+
+#endif
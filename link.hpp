@@ -0,0 +1,192 @@
+#ifndef DHTSIM_LINK_H
+#define DHTSIM_LINK_H
+
+#include "message.hpp"
+#include "snapshot.hpp"
+#include "time.hpp"
+
+#include <cstdint>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+
+namespace dhtsim {
+
+/**
+ * Bandwidth of one direction of a node's link, as a token bucket
+ * that fills at rate bytes per epoch and holds at most one epoch's
+ * worth.
+ *
+ * A message can go out as long as there are any tokens left, even if
+ * it's bigger than what's left: the bucket goes into debt, which is
+ * paid off in the following epochs. That's what makes a big message
+ * take longer to get through than a small one.
+ */
+class TokenBucket {
+public:
+	/** Start full at the given time. */
+	void reset(uint64_t rate, Time now) {
+		this->tokens = rate;
+		this->last = now;
+	}
+
+	/** Add what has come in since the last refill. */
+	void refill(uint64_t rate, Time now) {
+		if (now <= this->last) return;
+		uint64_t elapsed = now - this->last;
+		int64_t room = int64_t(rate) - this->tokens;
+		// Compare before multiplying so long idle periods can't overflow.
+		if (room <= 0 || elapsed >= uint64_t(room) / std::max<uint64_t>(rate, 1) + 1) {
+			this->tokens = rate;
+		} else {
+			this->tokens += rate * elapsed;
+		}
+		this->last = now;
+	}
+
+	/** Can anything be sent right now? */
+	bool ready() const { return this->tokens > 0; }
+
+	/**
+	 * Use up size bytes. Returns the serialization delay: how many
+	 * epochs after this one the last byte goes out.
+	 */
+	Time take(uint64_t size, uint64_t rate) {
+		this->tokens -= size;
+		if (this->tokens >= 0 || rate == 0) return 0;
+		return (uint64_t(-this->tokens) + rate - 1) / rate;
+	}
+
+private:
+	int64_t tokens = 0;
+	Time last = 0;
+};
+
+/**
+ * Messages waiting for a node's uplink, with one queue per
+ * destination. The queues are served by deficit round-robin, so a
+ * node sending a lot to one peer doesn't hold up what it sends to the
+ * others, and messages to the same peer always go out in the order
+ * they were sent.
+ */
+template <typename A> class TransmitQueues {
+public:
+	/**
+	 * How many bytes a queue may send per round. Roughly one
+	 * Ethernet frame, so small messages to different peers
+	 * interleave finely.
+	 */
+	static const uint64_t QUANTUM = 1500;
+
+	bool empty() const { return this->active.empty(); }
+	/** The number of messages waiting. */
+	size_t size() const { return this->count; }
+
+	/** The message that would go out next. Only call this if not empty. */
+	const Message<A>& next() const {
+		return this->queues.find(this->active.front())->second.messages.front();
+	}
+
+	void push(Message<A> message) {
+		A destination = message.destination;
+		auto& queue = this->queues[destination];
+		if (queue.messages.empty()) {
+			this->active.push_back(destination);
+		}
+		queue.messages.push_back(std::move(message));
+		this->count++;
+	}
+
+	/**
+	 * Hand messages to send, in round-robin order, for as long as
+	 * ready() says the link can take more.
+	 */
+	template <typename Ready, typename Send> void drain(Ready ready, Send send) {
+		while (!this->active.empty() && ready()) {
+			auto& queue = this->queues[this->active.front()];
+			// The queue at the front may have been cut off by
+			// the link last time, after it got its quantum.
+			if (!this->resuming) {
+				queue.deficit += QUANTUM;
+			}
+			this->resuming = false;
+
+			while (!queue.messages.empty()
+			       && queue.messages.front().data.size() <= queue.deficit) {
+				if (!ready()) {
+					this->resuming = true;
+					return;
+				}
+				queue.deficit -= queue.messages.front().data.size();
+				send(std::move(queue.messages.front()));
+				queue.messages.pop_front();
+				this->count--;
+			}
+
+			A destination = this->active.front();
+			this->active.pop_front();
+			if (queue.messages.empty()) {
+				// Idle queues don't save up credit.
+				this->queues.erase(destination);
+			} else {
+				this->active.push_back(destination);
+			}
+		}
+	}
+
+	/** Save the queues, in the order they'll be served. */
+	void save(SnapshotWriter& out) const {
+		out.u64(this->active.size());
+		for (A destination : this->active) {
+			const auto& queue = this->queues.find(destination)->second;
+			out.pod(destination);
+			out.pod(queue.deficit);
+			out.u64(queue.messages.size());
+			for (const auto& message : queue.messages) {
+				out.message(message);
+			}
+		}
+		out.pod(this->resuming);
+	}
+	void restore(SnapshotReader& in) {
+		this->clear();
+		uint64_t destinations = in.count(sizeof(A));
+		for (uint64_t i = 0; i < destinations && !in.failed(); i++) {
+			A destination = in.pod<A>();
+			uint64_t deficit = in.u64();
+			uint64_t messages = in.count(1);
+			if (messages == 0) {
+				in.fail();
+				break;
+			}
+			for (uint64_t j = 0; j < messages && !in.failed(); j++) {
+				this->push(in.message<A>());
+			}
+			this->queues[destination].deficit = deficit;
+		}
+		in.pod(this->resuming);
+	}
+
+	void clear() {
+		this->queues.clear();
+		this->active.clear();
+		this->count = 0;
+		this->resuming = false;
+	}
+
+private:
+	struct Queue {
+		std::deque<Message<A>> messages;
+		uint64_t deficit = 0;
+	};
+
+	std::unordered_map<A, Queue> queues;
+	/** Destinations with something waiting, in the order they're served. */
+	std::deque<A> active;
+	size_t count = 0;
+	bool resuming = false;
+};
+
+}
+
+#endif
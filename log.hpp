@@ -0,0 +1,33 @@
+#ifndef DHTSIM_LOG_H
+#define DHTSIM_LOG_H
+
+#include <iostream>
+
+namespace dhtsim {
+
+/*
+ * Output streams for code that runs inside an application's tick.
+ *
+ * When the network ticks applications on several threads, each
+ * worker points these at its own buffer, and the network writes the
+ * buffers out in address order at the end of the epoch. That keeps
+ * the output the same no matter how many threads there are. Outside
+ * of a tick they are just std::cout and std::clog, unless the thread
+ * running the simulation points them somewhere else.
+ */
+inline thread_local std::ostream* event_stream = nullptr;
+inline thread_local std::ostream* log_stream = nullptr;
+
+/** Where "[E]" event lines go. */
+inline std::ostream& eventStream() {
+	return event_stream ? *event_stream : std::cout;
+}
+
+/** Where diagnostics go. */
+inline std::ostream& logStream() {
+	return log_stream ? *log_stream : std::clog;
+}
+
+}
+
+#endif
@@ -1,6 +1,12 @@
 #include <iostream>
+#include <iomanip>
+#include <sstream>
 #include <chrono>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <cmath>
+#include <algorithm>
 
 #include "argh.h"
 
@@ -8,6 +14,11 @@
 #include "application.hpp"
 #include "base.hpp"
 #include "experiment.hpp"
+#include "event_log.hpp"
+#include "metrics.hpp"
+#include "snapshot.hpp"
+#include "thread_pool.hpp"
+#include "log.hpp"
 #include "kademlia/kademlia.hpp"
 #include "kademlia/message_structs.hpp"
 
@@ -15,15 +26,23 @@
 
 using namespace dhtsim;
 
-KademliaNode::Config global_kademlia_config;
-
 template <typename Node>
 class ChurnExperiment : public Experiment<Node> {
 
 public:
 	ChurnExperiment(CentralizedNetwork<uint32_t> &net,
-	                const std::vector<std::shared_ptr<Application<uint32_t>>> &nodes)
-		: Experiment<Node>(net, nodes) {}
+	                const std::vector<std::shared_ptr<Application<uint32_t>>> &nodes,
+	                typename Node::Config config)
+		: Experiment<Node>(net, nodes, config) {}
+
+	unsigned int iterations = 50000;
+
+	/**
+	 * How skewed fetches are: the data to fetch is picked by a
+	 * Zipf law with this exponent, node 0's the most popular. 0
+	 * picks uniformly.
+	 */
+	double zipf = 0;
 
 	virtual void init() {
 		this->stored_data_keys.clear();
@@ -40,10 +59,18 @@ public:
 	}
 
 	virtual void run() {
-		unsigned int max_iterations = 50000;
 		unsigned int i;
 
-		for (i = 0; i < max_iterations; i++) {
+		this->popularity.clear();
+		if (this->zipf > 0) {
+			double total = 0;
+			for (i = 0; i < this->nodes.size(); i++) {
+				total += 1 / std::pow(i + 1, this->zipf);
+				this->popularity.push_back(total);
+			}
+		}
+
+		for (i = 0; i < this->iterations; i++) {
 			this->current_epoch = i;
 
 			// We kill off a random node and replace it
@@ -51,7 +78,7 @@ public:
 			if (i % 10 == 0) {
 				// we do not kill node zero
 				auto node_index = global_rng.Size_T(1, this->nodes.size()-1);
-				std::cout << "[E] R " << node_index << std::endl;
+				logEvent(EventRecord::replace(node_index));
 				auto new_node = this->create();
 				this->nodes[node_index]->die();
 				this->net.remove(std::static_pointer_cast<Application<uint32_t>>(this->nodes[node_index]));
@@ -63,7 +90,7 @@ public:
 
 
 			auto node_index = global_rng.Size_T(0, this->nodes.size()-1);
-			auto target_data_index = global_rng.Size_T(0, this->nodes.size()-1);
+			auto target_data_index = this->pickData();
 #ifdef DEBUG
 			std::cout << node_index << " wants to find " << target_data_index << std::endl;
 #endif
@@ -86,11 +113,24 @@ public:
 
 	}
 
+private:
+	/** Running totals of the Zipf weights, by data index. */
+	std::vector<double> popularity;
+
+	size_t pickData() {
+		if (this->popularity.empty()) {
+			return global_rng.Size_T(0, this->nodes.size()-1);
+		}
+		double x = global_rng.Double_01() * this->popularity.back();
+		auto it = std::upper_bound(this->popularity.begin(), this->popularity.end(), x);
+		return std::min<size_t>(it - this->popularity.begin(), this->popularity.size() - 1);
+	}
+
 };
 
 template<>
 std::shared_ptr<KademliaNode> Experiment<KademliaNode>::create() {
-	return std::make_shared<KademliaNode>(global_kademlia_config);
+	return std::make_shared<KademliaNode>(this->config);
 }
 
 template <>
@@ -110,67 +150,371 @@ void Experiment<KademliaNode>::fetch(const std::shared_ptr<Application<uint32_t>
                                      const KademliaNode::Key& key,
                                      Experiment::FetchCallbackSet cb) {
 	auto storer_cast = std::static_pointer_cast<KademliaNode>(storer);
-        auto cb_success = [=](FindNodesMessage fm) {
+	auto shared_cb = std::make_shared<Experiment::FetchCallbackSet>(std::move(cb));
+        auto cb_success = [shared_cb](FindNodesMessage fm) {
 				  if (fm.value_found) {
-					  cb.success(fm.value);
+					  shared_cb->success(fm.value);
 				  }
 			  };
-	auto cb_fail = [=](FindNodesMessage fm) {
+	auto cb_fail = [shared_cb](FindNodesMessage fm) {
 		               (void) fm;
-			       cb.failure(1);
+			       shared_cb->failure(1);
 		       };
 
-	storer_cast->findValue(key, KademliaNode::FindNodesCallbackSet(cb_success, cb_fail));
+	storer_cast->findValue(key, KademliaNode::FindNodesCallbackSet(std::move(cb_success), std::move(cb_fail)));
 }
 
 
-int main(int, char* argv[]) {
-	unsigned long link_limit, n_nodes;
-	argh::parser cmdl(argv);
-	cmdl("k", 10) >> global_kademlia_config.k;
-	cmdl("alpha", 3) >> global_kademlia_config.alpha;
-	cmdl("mp", 10000) >> global_kademlia_config.maintenance_period;
-	cmdl("rp", 1000) >> global_kademlia_config.bucket_refresh_period;
+/** Everything that describes one simulation run. */
+struct Settings {
+	KademliaNode::Config kademlia;
+	unsigned long link_limit, downlink_limit, n_nodes, n_threads;
+	bool coalesce;
+	unsigned long frame_header;
+	std::string latency;
+	unsigned long delay, delay_max, latency_seed;
+	double pareto_shape;
+	unsigned long seed, iterations;
+	double zipf;
+	std::string snapshot_path, save_snapshot_path;
+};
 
-	cmdl("ll", 1<<16) >> link_limit;
+/** What a run measured. */
+struct Results {
+	Histogram latencies;
+	uint64_t failures = 0;
+	/** Bytes sent and epochs run during the experiment proper. */
+	unsigned long long bytes = 0;
+	Time epochs = 0;
+	double seconds = 0;
+
+	void merge(const Results& other) {
+		this->latencies.merge(other.latencies);
+		this->failures += other.failures;
+		this->bytes += other.bytes;
+		this->epochs += other.epochs;
+		this->seconds += other.seconds;
+	}
+};
 
-	cmdl("nn", 400) >> n_nodes;
-	std::clog << "Global network options: " << std::endl
-	          << "Link limit: " << link_limit << std::endl
-	          << "# nodes...: " << n_nodes << std::endl;
-	std::clog << "Kademlia options:" << std::endl
-		  << global_kademlia_config << std::endl;
+static std::unique_ptr<LatencyModel<uint32_t>> makeLatencyModel(const Settings& s) {
+	if (s.latency == "constant") {
+		return std::make_unique<ConstantLatency<uint32_t>>(s.delay);
+	} else if (s.latency == "coords") {
+		return std::make_unique<CoordinateLatency<uint32_t>>(s.delay, s.delay_max, s.latency_seed);
+	} else if (s.latency == "pareto") {
+		return std::make_unique<ParetoLatency<uint32_t>>(s.delay, s.delay_max, s.pareto_shape,
+		                                                 s.latency_seed);
+	}
+	return nullptr;
+}
 
-	std::clog << "[startup]" << std::endl;
-	CentralizedNetwork<uint32_t> net(link_limit);
+/**
+ * Build the network (or restore it from a snapshot), warm it up and
+ * run the churn experiment on it. Events and diagnostics go to the
+ * calling thread's eventStream() and logStream(). Returns false if
+ * the run couldn't be set up.
+ */
+static bool simulate(const Settings& s, Results& results) {
+	auto start = std::chrono::steady_clock::now();
+	global_rng = Random::Generator(s.seed);
+
+	logStream() << "[startup]" << std::endl;
+	CentralizedNetwork<uint32_t> net(s.link_limit, s.n_threads);
+	net.downlinkLimit = s.downlink_limit;
+	net.coalesce = s.coalesce;
+	net.frameHeader = s.frame_header;
+	net.setLatencyModel(makeLatencyModel(s));
 
 	unsigned long i;
 
 	std::vector<std::shared_ptr<Application<uint32_t>>> nodes;
-        auto node_zero = std::make_shared<KademliaNode>(global_kademlia_config);
-        net.add(node_zero);
-        nodes.push_back(node_zero);
-        auto node_zero_address = node_zero->getAddress();
+	if (s.snapshot_path.empty()) {
+		auto node_zero = std::make_shared<KademliaNode>(s.kademlia);
+		net.add(node_zero);
+		nodes.push_back(node_zero);
+		auto node_zero_address = node_zero->getAddress();
+
+		for (i = 1; i < s.n_nodes; i++) {
+			auto node = std::make_shared<KademliaNode>(s.kademlia);
+			net.add(node);
+			node->ping(node_zero_address, KademliaNode::PingCallbackSet());
+			nodes.push_back(node);
+			logStream() << "Node " << i << " address: " << node->getAddress()
+			            << std::endl;
+			logStream() << "Node " << i << " key: " << node->getKey()
+			            << std::endl;
 
-	for (i = 1; i < n_nodes; i++) {
-		auto node = std::make_shared<KademliaNode>(global_kademlia_config);
-		net.add(node);
-		node->ping(node_zero_address, KademliaNode::PingCallbackSet());
-		nodes.push_back(node);
-		std::clog << "Node " << i << " address: " << node->getAddress()
-		          << std::endl;
-		std::clog << "Node " << i << " key: " << node->getKey()
-		          << std::endl;
+		}
 
+		// complete the warmup
+		for (i = 0; i < 100; i++) {
+			net.tick();
+		}
 	}
 
-	// complete the warmup
-	for (i = 0; i < 100; i++) {
-		net.tick();
+	auto exp = ChurnExperiment<KademliaNode>(net, nodes, s.kademlia);
+	exp.iterations = s.iterations;
+	exp.zipf = s.zipf;
+	if (s.snapshot_path.empty()) {
+		exp.init();
+	} else {
+		SnapshotReader in;
+		auto make = [&s]() { return std::make_shared<KademliaNode>(s.kademlia); };
+		bool ok = in.open(s.snapshot_path) && net.restore(in, make) && exp.restore(in);
+		in.generator(global_rng);
+		if (!ok || in.failed() || !in.done()) {
+			std::cerr << "Can't restore snapshot " << s.snapshot_path << std::endl;
+			return false;
+		}
+		logStream() << "[restored at epoch " << net.current_epoch() << "]" << std::endl;
 	}
 
-	auto exp = ChurnExperiment<KademliaNode>(net, nodes);
-	exp.init();
+	if (!s.save_snapshot_path.empty()) {
+		SnapshotWriter out;
+		bool ok = out.open(s.save_snapshot_path);
+		net.save(out);
+		exp.save(out);
+		out.generator(global_rng);
+		if (!ok || !out.close()) {
+			std::cerr << "Can't write snapshot " << s.save_snapshot_path << std::endl;
+			return false;
+		}
+	}
+
+	auto bytes = net.bytesTransferred();
+	auto epoch = net.current_epoch();
 	exp.run();
 
+	results.latencies = exp.fetchLatencies();
+	results.failures = exp.fetchFailures();
+	results.bytes = net.bytesTransferred() - bytes;
+	results.epochs = net.current_epoch() - epoch;
+	results.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return true;
+}
+
+/** A comma separated list of numbers from the command line, e.g. --k=10,20. */
+static bool listOption(argh::parser& cmdl, const char* name, unsigned long fallback,
+                       std::vector<unsigned long>& values) {
+	std::string text;
+	cmdl(name, std::to_string(fallback)) >> text;
+	std::stringstream items(text);
+	std::string item;
+	values.clear();
+	while (std::getline(items, item, ',')) {
+		char* end;
+		values.push_back(std::strtoul(item.c_str(), &end, 10));
+		if (item.empty() || *end != '\0') {
+			std::cerr << "Bad value for --" << name << ": " << item << std::endl;
+			return false;
+		}
+	}
+	return !values.empty();
+}
+
+/**
+ * Run every combination of the given settings, each replicates times
+ * with seeds counting up from settings.seed, on jobs threads at once.
+ * Prints one line per combination, over all of its replicates:
+ * how many fetches there were, the percentage that failed, the mean
+ * and percentiles of the epochs successful ones took, the mean bytes
+ * sent per epoch, and the mean wall time of a run.
+ */
+static int sweep(const std::vector<Settings>& grid, unsigned long replicates, unsigned long jobs) {
+	std::vector<Settings> runs;
+	for (const auto& settings : grid) {
+		for (unsigned long r = 0; r < replicates; r++) {
+			runs.push_back(settings);
+			runs.back().seed += r;
+		}
+	}
+	std::vector<Results> results(runs.size());
+	std::vector<char> ok(runs.size(), 0);
+
+	// Each worker takes the next run that nobody has started.
+	std::atomic<size_t> next(0);
+	std::mutex progress;
+	size_t finished = 0;
+	auto work = [&](unsigned int) {
+		// Only the summary is printed, so the runs' own output
+		// goes nowhere.
+		std::ostream discard(nullptr);
+		auto events = event_stream;
+		auto log = log_stream;
+		event_stream = &discard;
+		log_stream = &discard;
+		for (size_t i = next++; i < runs.size(); i = next++) {
+			ok[i] = simulate(runs[i], results[i]);
+			std::lock_guard<std::mutex> guard(progress);
+			std::clog << "[sweep] " << ++finished << "/" << runs.size() << " runs done"
+			          << std::endl;
+		}
+		event_stream = events;
+		log_stream = log;
+	};
+	unsigned int threads = std::max<unsigned long>(1, std::min<unsigned long>(jobs, runs.size()));
+	ThreadPool pool(threads);
+	pool.run(threads, work);
+
+	std::cout << "# k alpha mp rp nn ll dl cache runs fetches fail% lat_mean lat_p50 lat_p90 lat_p99"
+	          << " bytes_per_epoch wall_s" << std::endl;
+	std::cout << std::fixed;
+	for (size_t g = 0; g < grid.size(); g++) {
+		Results total;
+		for (unsigned long r = 0; r < replicates; r++) {
+			size_t i = g * replicates + r;
+			if (!ok[i]) return 1;
+			total.merge(results[i]);
+		}
+		const auto& s = grid[g];
+		const auto& h = total.latencies;
+		uint64_t fetches = h.count() + total.failures;
+		std::cout << s.kademlia.k << " " << s.kademlia.alpha << " "
+		          << s.kademlia.maintenance_period << " " << s.kademlia.bucket_refresh_period << " "
+		          << s.n_nodes << " " << s.link_limit << " " << s.downlink_limit << " "
+		          << s.kademlia.cache_period << " " << replicates << " " << fetches << " "
+		          << std::setprecision(2) << (fetches ? 100.0 * total.failures / fetches : 0.0) << " "
+		          << h.mean() << " " << h.percentile(0.5) << " " << h.percentile(0.9) << " "
+		          << h.percentile(0.99) << " "
+		          << std::setprecision(1) << (total.epochs ? double(total.bytes) / total.epochs : 0.0)
+		          << " " << std::setprecision(2) << total.seconds / replicates << std::endl;
+	}
+	return 0;
+}
+
+int main(int, char* argv[]) {
+	argh::parser cmdl(argv);
+
+	// With --sweep, any of these can be a comma separated list,
+	// and every combination is run. --cache=N caches values found
+	// by lookups along their paths for up to N epochs.
+	std::vector<unsigned long> ks, alphas, mps, rps, lls, dls, nns, caches;
+	if (!listOption(cmdl, "k", 10, ks) || !listOption(cmdl, "alpha", 3, alphas)
+	    || !listOption(cmdl, "mp", 10000, mps) || !listOption(cmdl, "rp", 1000, rps)
+	    || !listOption(cmdl, "ll", 1<<16, lls) || !listOption(cmdl, "dl", 0, dls)
+	    || !listOption(cmdl, "nn", 400, nns) || !listOption(cmdl, "cache", 0, caches)) {
+		return 1;
+	}
+
+	Settings settings;
+	cmdl("threads", 1) >> settings.n_threads;
+	cmdl("seed", 1234) >> settings.seed;
+	cmdl("iterations", 50000) >> settings.iterations;
+	// --coalesce sends everything a node has for the same peer in
+	// an epoch as one frame; every frame costs --frame-header bytes
+	// on top of its messages.
+	settings.coalesce = cmdl["coalesce"];
+	cmdl("frame-header", 0) >> settings.frame_header;
+	// --zipf=S skews fetches towards a few popular values.
+	cmdl("zipf", 0) >> settings.zipf;
+	// Republished values go to each node in batches of up to
+	// --store-batch bytes, or the link limit if that's less; 0
+	// sends them one at a time.
+	long store_batch;
+	cmdl("store-batch", -1) >> store_batch;
+
+	// --save-snapshot=FILE saves the warmed up network, right
+	// before the experiment starts; --snapshot=FILE starts from
+	// one instead of warming up. The Kademlia options are then the
+	// snapshot's, but the network options are still taken from the
+	// command line.
+	cmdl("snapshot") >> settings.snapshot_path;
+	cmdl("save-snapshot") >> settings.save_snapshot_path;
+
+	// --latency picks how long messages take: "constant" (--delay
+	// epochs), "coords" (--delay to --delay-max, by distance between
+	// made-up coordinates) or "pareto" (mostly --delay, with a tail
+	// out to --delay-max).
+	cmdl("latency", "constant") >> settings.latency;
+	cmdl("delay", 1) >> settings.delay;
+	cmdl("delay-max", 10) >> settings.delay_max;
+	cmdl("pareto-shape", 1.5) >> settings.pareto_shape;
+	cmdl("latency-seed", 1) >> settings.latency_seed;
+	if (!makeLatencyModel(settings)) {
+		std::cerr << "Unknown latency model " << settings.latency << std::endl;
+		return 1;
+	}
+
+	std::vector<Settings> grid;
+	for (auto k : ks) for (auto alpha : alphas) for (auto mp : mps) for (auto rp : rps)
+	for (auto nn : nns) for (auto ll : lls) for (auto dl : dls) for (auto cache : caches) {
+		Settings s = settings;
+		s.kademlia.k = k;
+		s.kademlia.alpha = alpha;
+		s.kademlia.maintenance_period = mp;
+		s.kademlia.bucket_refresh_period = rp;
+		s.kademlia.cache_period = cache;
+		s.kademlia.store_batch = store_batch < 0 ? ll : store_batch;
+		s.n_nodes = nn;
+		s.link_limit = ll;
+		// The downlink is as fast as the uplink unless it's set.
+		s.downlink_limit = dl ? dl : ll;
+		grid.push_back(s);
+	}
+
+	// With --events=FILE, events go to a binary log instead of
+	// stdout. Read it back with tools/eventdump.
+	std::string events_path;
+	cmdl("events") >> events_path;
+
+	// With --metrics=FILE, protocol metrics are written there every
+	// --metrics-interval epochs.
+	std::string metrics_path;
+	unsigned long metrics_interval;
+	cmdl("metrics") >> metrics_path;
+	cmdl("metrics-interval", 100) >> metrics_interval;
+
+	// --sweep runs all of them, --replicates times each with
+	// different seeds, --jobs at a time (default: one per core),
+	// and prints a summary table instead of events.
+	if (cmdl["sweep"]) {
+		unsigned long replicates, jobs;
+		cmdl("replicates", 1) >> replicates;
+		cmdl("jobs", std::max(1u, std::thread::hardware_concurrency())) >> jobs;
+		if (!settings.save_snapshot_path.empty() || !events_path.empty()
+		    || !metrics_path.empty()) {
+			std::cerr << "--save-snapshot, --events and --metrics don't work with --sweep"
+			          << std::endl;
+			return 1;
+		}
+		// The runs share the process, so they each get one thread.
+		for (auto& s : grid) {
+			s.n_threads = 1;
+		}
+		return sweep(grid, std::max(1ul, replicates), jobs);
+	}
+	if (grid.size() > 1) {
+		std::cerr << "Lists of values only work with --sweep" << std::endl;
+		return 1;
+	}
+	settings = grid[0];
+
+	if (!events_path.empty() && !EventLog::global().open(events_path)) {
+		std::cerr << "Can't open event log " << events_path << std::endl;
+		return 1;
+	}
+
+	if (!metrics_path.empty() && !Metrics::global().open(metrics_path, metrics_interval)) {
+		std::cerr << "Can't open metrics file " << metrics_path << std::endl;
+		return 1;
+	}
+
+	std::clog << "Global network options: " << std::endl
+	          << "Link limit: " << settings.link_limit << std::endl
+	          << "Downlink..: " << settings.downlink_limit << std::endl
+	          << "Coalesce..: " << (settings.coalesce ? "yes" : "no")
+	          << ", frame header " << settings.frame_header << std::endl
+	          << "# nodes...: " << settings.n_nodes << std::endl
+	          << "# threads.: " << settings.n_threads << std::endl
+	          << "Latency...: " << settings.latency << std::endl;
+	std::clog << "Kademlia options:" << std::endl
+		  << settings.kademlia << std::endl;
+
+	Results results;
+	bool ok = simulate(settings, results);
+
+	EventLog::global().close();
+	Metrics::global().close();
+	return ok ? 0 : 1;
 }
@@ -3,12 +3,13 @@
 
 #include <random>
 #include <vector>
-#include <sstream>
+
+#include "payload.hpp"
 
 #include <nop/structure.h>
 #include <nop/serializer.h>
-#include <nop/utility/stream_reader.h>
-#include <nop/utility/stream_writer.h>
+#include <nop/utility/buffer_reader.h>
+#include <nop/utility/buffer_writer.h>
 
 
 namespace dhtsim {
@@ -22,30 +23,36 @@ public:
 	unsigned long tag;
 	unsigned int hops;
 
-	std::vector<unsigned char> data;
+	/** The contents. Copying a message doesn't copy these. */
+	Payload data;
 
-        Message() {}
+        Message() : type(0), originator(), destination(), tag(0), hops(0) {}
 
         Message(unsigned int type, A originator, A destination,
-	        unsigned long tag, std::vector<unsigned char> data)
+	        unsigned long tag, Payload data = Payload())
             : type(type), originator(originator), destination(destination),
-              tag(tag), hops(0), data(data) {}
+              tag(tag), hops(0), data(std::move(data)) {}
 };
 
 
-template <typename T, typename A> static void writeToMessage(T msg_data, Message<A>& m) {
-	nop::Serializer<nop::StreamWriter<std::stringstream>> serializer;
-	serializer.Write(msg_data);
-	const std::string data = serializer.writer().take().str();
-	m.data.resize(data.length());
-	std::copy(data.begin(), data.end(), m.data.begin());
+/**
+ * Serialize msg_data straight into a freshly allocated payload for
+ * m. The encoded size is computed up front, so this is one pass over
+ * the structure and no intermediate buffers. The wire format is plain
+ * libnop.
+ */
+template <typename T, typename A> static bool writeToMessage(const T& msg_data, Message<A>& m) {
+	m.data = Payload::allocate(nop::Encoding<T>::Size(msg_data));
+	nop::Serializer<nop::BufferWriter> serializer{m.data.mutableData(), m.data.size()};
+	return serializer.Write(msg_data).ok();
 }
-template <typename T, typename A> static void readFromMessage(T& msg_data, const Message<A>& m) {
-	std::string data(m.data.begin(), m.data.end());
-	std::stringstream ss;
-	ss.str(data);
-	nop::Deserializer<nop::StreamReader<std::stringstream>> deserializer{std::move(ss)};
-	deserializer.Read(&msg_data);
+/**
+ * Deserialize m's payload into msg_data, in place. Returns false if
+ * the payload is malformed; reads never go past its end.
+ */
+template <typename T, typename A> static bool readFromMessage(T& msg_data, const Message<A>& m) {
+	nop::Deserializer<nop::BufferReader> deserializer{m.data.data(), m.data.size()};
+	return deserializer.Read(&msg_data).ok();
 }
 
 }
@@ -0,0 +1,133 @@
+#include "metrics.hpp"
+
+#include <cstring>
+
+using namespace dhtsim;
+
+void Histogram::merge(const Histogram& other) {
+	for (unsigned int i = 0; i < BUCKETS; i++) {
+		this->counts[i] += other.counts[i];
+	}
+	this->total += other.total;
+	this->sum += other.sum;
+	if (other.maximum > this->maximum) this->maximum = other.maximum;
+}
+
+void Histogram::clear() {
+	std::memset(this->counts, 0, sizeof(this->counts));
+	this->total = 0;
+	this->sum = 0;
+	this->maximum = 0;
+}
+
+uint64_t Histogram::percentile(double fraction) const {
+	if (this->total == 0) return 0;
+	uint64_t wanted = fraction * this->total;
+	if (wanted == 0) wanted = 1;
+	uint64_t seen = 0;
+	for (unsigned int i = 0; i < BUCKETS; i++) {
+		seen += this->counts[i];
+		if (seen >= wanted) {
+			uint64_t value = lowestIn(i);
+			return value < this->maximum ? value : this->maximum;
+		}
+	}
+	return this->maximum;
+}
+
+Metrics::Metrics() {
+	for (unsigned int t = 0; t < MESSAGE_TYPES; t++) {
+		this->messageCounts[t] = this->counter("net.messages." + std::to_string(t));
+		this->messageBytes[t] = this->counter("net.bytes." + std::to_string(t));
+	}
+}
+
+Metrics::Id Metrics::counter(const std::string& name) {
+	std::lock_guard<std::mutex> guard(this->lock);
+	for (Id id = 0; id < this->counterNames.size(); id++) {
+		if (this->counterNames[id] == name) return id;
+	}
+	this->counterNames.push_back(name);
+	return this->counterNames.size() - 1;
+}
+
+Metrics::Id Metrics::histogram(const std::string& name) {
+	std::lock_guard<std::mutex> guard(this->lock);
+	for (Id id = 0; id < this->histogramNames.size(); id++) {
+		if (this->histogramNames[id] == name) return id;
+	}
+	this->histogramNames.push_back(name);
+	return this->histogramNames.size() - 1;
+}
+
+void Metrics::nameMessageType(int type, const std::string& name) {
+	if (type < 0 || unsigned(type) >= MESSAGE_TYPES - 1) return;
+	std::lock_guard<std::mutex> guard(this->lock);
+	this->counterNames[this->messageCounts[type]] = "net.messages." + name;
+	this->counterNames[this->messageBytes[type]] = "net.bytes." + name;
+}
+
+Metrics::Shard& Metrics::local() {
+	// The shards belong to the registry, so they outlive the
+	// threads that fill them.
+	static thread_local Shard* shard = nullptr;
+	if (shard == nullptr) {
+		std::lock_guard<std::mutex> guard(this->lock);
+		this->shards.push_back(std::make_unique<Shard>());
+		shard = this->shards.back().get();
+	}
+	return *shard;
+}
+
+bool Metrics::open(const std::string& path, Time interval) {
+	this->close();
+	this->file = std::fopen(path.c_str(), "w");
+	this->interval = interval > 0 ? interval : 1;
+	return this->file != nullptr;
+}
+
+void Metrics::close() {
+	if (this->file == nullptr) return;
+	std::fclose(this->file);
+	this->file = nullptr;
+}
+
+void Metrics::endEpoch(Time epoch) {
+	if (!this->enabled()) return;
+	if ((epoch + 1) % this->interval == 0) {
+		this->flush(epoch);
+	}
+}
+
+void Metrics::flush(Time epoch) {
+	std::lock_guard<std::mutex> guard(this->lock);
+
+	std::vector<uint64_t> counters(this->counterNames.size(), 0);
+	std::vector<Histogram> histograms(this->histogramNames.size());
+	for (auto& shard : this->shards) {
+		for (size_t i = 0; i < shard->counters.size(); i++) {
+			counters[i] += shard->counters[i];
+			shard->counters[i] = 0;
+		}
+		for (size_t i = 0; i < shard->histograms.size(); i++) {
+			histograms[i].merge(shard->histograms[i]);
+			shard->histograms[i].clear();
+		}
+	}
+
+	unsigned long long e = epoch;
+	for (size_t i = 0; i < counters.size(); i++) {
+		// Unused message types would just be noise. Their
+		// counters were registered first.
+		if (counters[i] == 0 && i < 2 * MESSAGE_TYPES) continue;
+		std::fprintf(this->file, "%llu %s %llu\n", e, this->counterNames[i].c_str(),
+		             (unsigned long long) counters[i]);
+	}
+	for (size_t i = 0; i < histograms.size(); i++) {
+		const auto& h = histograms[i];
+		std::fprintf(this->file, "%llu %s %llu %.2f %llu %llu %llu %llu\n", e,
+		             this->histogramNames[i].c_str(), (unsigned long long) h.count(), h.mean(),
+		             (unsigned long long) h.percentile(0.5), (unsigned long long) h.percentile(0.9),
+		             (unsigned long long) h.percentile(0.99), (unsigned long long) h.max());
+	}
+}
@@ -0,0 +1,160 @@
+#ifndef DHTSIM_METRICS_H
+#define DHTSIM_METRICS_H
+
+#include "time.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+
+namespace dhtsim {
+
+/**
+ * A histogram with buckets that are linear within each power of two
+ * (the HDR histogram layout): 16 buckets between 2^n and 2^(n+1), so
+ * any value is off by at most 1/16 whatever its size. Recording is
+ * an array increment.
+ */
+class Histogram {
+public:
+	static const unsigned int SUB_BITS = 4;
+	static const unsigned int SUB_BUCKETS = 1 << SUB_BITS;
+	static const unsigned int BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+	Histogram() { this->clear(); }
+
+	void record(uint64_t value) {
+		this->counts[indexOf(value)]++;
+		this->total++;
+		this->sum += value;
+		if (value > this->maximum) this->maximum = value;
+	}
+
+	void merge(const Histogram& other);
+	void clear();
+
+	uint64_t count() const { return this->total; }
+	uint64_t max() const { return this->maximum; }
+	double mean() const { return this->total ? double(this->sum) / this->total : 0; }
+	/** The value below which the given fraction of the values fall. */
+	uint64_t percentile(double fraction) const;
+
+	static unsigned int indexOf(uint64_t value) {
+		if (value < SUB_BUCKETS) return value;
+		unsigned int top = 63 - __builtin_clzll(value);
+		unsigned int shift = top - SUB_BITS;
+		return ((shift + 1) << SUB_BITS) + ((value >> shift) & (SUB_BUCKETS - 1));
+	}
+	/** The smallest value that goes in bucket index. */
+	static uint64_t lowestIn(unsigned int index) {
+		if (index < SUB_BUCKETS) return index;
+		unsigned int shift = (index >> SUB_BITS) - 1;
+		return uint64_t(SUB_BUCKETS | (index & (SUB_BUCKETS - 1))) << shift;
+	}
+
+private:
+	uint64_t counts[BUCKETS];
+	uint64_t total, sum, maximum;
+};
+
+/**
+ * Counters and histograms describing what the simulation is doing,
+ * written out every so many epochs.
+ *
+ * Metrics are registered by name and then updated through the id
+ * that comes back. Updates go to a per-thread copy, so ticks running
+ * on different threads never contend; the network adds up the copies
+ * at the end of an epoch, when no ticks are running, and writes one
+ * line per metric to the metrics file:
+ *
+ *   epoch name value
+ *   epoch name count mean p50 p90 p99 max
+ *
+ * The counts cover the epochs since the previous flush. When no
+ * metrics file is open, updates are dropped right away.
+ */
+class Metrics {
+public:
+	using Id = unsigned int;
+
+	/** Message types after this all count as the last one. */
+	static const unsigned int MESSAGE_TYPES = 16;
+
+	static Metrics& global() {
+		static Metrics metrics;
+		return metrics;
+	}
+
+	~Metrics() { this->close(); }
+
+	/** Register a counter, or find the one with that name. */
+	Id counter(const std::string& name);
+	/** Register a histogram, or find the one with that name. */
+	Id histogram(const std::string& name);
+
+	/** Name a message type in the per-type counters. */
+	void nameMessageType(int type, const std::string& name);
+
+	/**
+	 * Start writing metrics to the given file every interval
+	 * epochs. Returns false if it can't be opened.
+	 */
+	bool open(const std::string& path, Time interval);
+	void close();
+	bool enabled() const { return this->file != nullptr; }
+
+	void add(Id id, uint64_t n = 1) {
+		if (!this->enabled()) return;
+		auto& counters = this->local().counters;
+		if (id >= counters.size()) counters.resize(id + 1, 0);
+		counters[id] += n;
+	}
+	void record(Id id, uint64_t value) {
+		if (!this->enabled()) return;
+		auto& histograms = this->local().histograms;
+		if (id >= histograms.size()) histograms.resize(id + 1);
+		histograms[id].record(value);
+	}
+	/** Count a message of the given type and size going out. */
+	void messageSent(int type, uint64_t bytes) {
+		if (!this->enabled()) return;
+		unsigned int t = type < 0 || unsigned(type) >= MESSAGE_TYPES
+			? MESSAGE_TYPES - 1 : unsigned(type);
+		this->add(this->messageCounts[t]);
+		this->add(this->messageBytes[t], bytes);
+	}
+
+	/**
+	 * Called by the network when an epoch is over, with no ticks
+	 * running. Writes the metrics out if an interval is up.
+	 */
+	void endEpoch(Time epoch);
+
+private:
+	Metrics();
+
+	/** One thread's copy of the metrics. */
+	struct Shard {
+		std::vector<uint64_t> counters;
+		std::vector<Histogram> histograms;
+	};
+	Shard& local();
+	void flush(Time epoch);
+
+	std::mutex lock;
+	std::vector<std::string> counterNames, histogramNames;
+	std::vector<std::unique_ptr<Shard>> shards;
+
+	Id messageCounts[MESSAGE_TYPES];
+	Id messageBytes[MESSAGE_TYPES];
+
+	std::FILE* file = nullptr;
+	Time interval = 0;
+};
+
+}
+
+#endif
@@ -1,8 +1,10 @@
 #include "network.hpp"
 #include "application.hpp"
-#include "random.h"
+#include "log.hpp"
+#include "event_log.hpp"
+#include "metrics.hpp"
 #include <iostream>
-#include <map>
+#include <vector>
 #include <climits>
 #include <functional>
 #include <memory>
@@ -10,95 +12,479 @@
 
 using namespace dhtsim;
 
-template <typename A> CentralizedNetwork<A>::CentralizedNetwork(unsigned int linkLimit) {
+template <typename A> CentralizedNetwork<A>::CentralizedNetwork(unsigned int linkLimit,
+                                                                unsigned int threads) {
 	this->linkLimit = linkLimit;
+	this->downlinkLimit = linkLimit;
 	this->epoch = 0;
+	this->latency = std::make_unique<ConstantLatency<A>>(1);
+	if (threads == 0) threads = 1;
+	this->shards.resize(threads);
+	if (threads > 1) {
+		this->pool = std::make_unique<ThreadPool>(threads);
+	}
 }
 template <typename A> A CentralizedNetwork<A>::getNewAddress() {
-	A attempt;
-	const uint32_t max_tries = 1000;
-	uint32_t tries;
+	A slot;
+	if (!this->freeSlots.empty()) {
+		slot = this->freeSlots.back();
+		this->freeSlots.pop_back();
+	} else {
+		slot = this->inhabitants.size();
+		if (slot > SLOT_MASK) {
+			// The table is full.
+			return 0;
+		}
+		this->inhabitants.emplace_back();
+	}
 
-	for (tries = 0; tries < max_tries; tries++) {
-		attempt = global_rng.Number<A>(std::pair(0, std::numeric_limits<A>::max()));
-	        auto it = this->inhabitants.find(attempt);
-	        if (it == this->inhabitants.end()) {
-		        return attempt;
-	        }
-        }
+	// Generation 0 is skipped so that no address is 0.
+	auto& inhabitant = this->inhabitants[slot];
+	inhabitant.generation = (inhabitant.generation + 1) & GENERATION_MASK;
+	if (inhabitant.generation == 0) {
+		inhabitant.generation = 1;
+	}
+	return (inhabitant.generation << SLOT_BITS) | slot;
+}
 
-	return 0;
+template <typename A>
+typename CentralizedNetwork<A>::Inhabitant* CentralizedNetwork<A>::find(A address) {
+	A slot = address & SLOT_MASK;
+	if (slot >= this->inhabitants.size()) return nullptr;
+	auto& inhabitant = this->inhabitants[slot];
+	if (inhabitant.address != address) return nullptr;
+	return &inhabitant;
 }
 
 template <typename A> A CentralizedNetwork<A>::add(std::shared_ptr<Application<A>> app) {
 	A address = this->getNewAddress();
 	if (address == 0) return address;
 
-	this->inhabitants[address] = app;
+	auto& inhabitant = this->inhabitants[address & SLOT_MASK];
+	inhabitant.app = app;
+	inhabitant.address = address;
+	inhabitant.lastTick = NEVER;
+	inhabitant.nextTimer = NEVER;
+	inhabitant.uplink.reset(this->linkLimit, this->epoch);
+	inhabitant.downlink.reset(this->downlinkLimit, this->epoch);
 	app->setAddress(address);
+	app->setScheduler(this);
 	app->tick(this->epoch);
+	this->wakeAt(address, app->nextWakeup());
 	return address;
 }
 
 template <typename A> void CentralizedNetwork<A>::remove(std::shared_ptr<Application<A>> app) {
-	this->inhabitants.erase(app->getAddress());
+	// Any events still queued for it are skipped when they come up.
+	auto inhabitant = this->find(app->getAddress());
+	if (inhabitant == nullptr) return;
+	inhabitant->app.reset();
+	inhabitant->address = 0;
+	inhabitant->transmit.clear();
+	inhabitant->arrivals.clear();
+	inhabitant->congested = false;
+	this->freeSlots.push_back(app->getAddress() & SLOT_MASK);
+}
+
+template <typename A> void CentralizedNetwork<A>::schedule(A address, Time time) {
+	this->events.push({std::max(time, this->epoch), address});
+}
+
+template <typename A> void CentralizedNetwork<A>::wakeAt(A address, Time time) {
+	if (time == NEVER) return;
+
+	// Applications being ticked get their outqueue drained and
+	// their next wakeup checked right after their tick anyway.
+	if (this->ticking) return;
+
+	auto inhabitant = this->find(address);
+	if (inhabitant == nullptr) return;
+
+	// Timers are asked for again after every tick, so don't queue
+	// the same one twice.
+	if (time > this->epoch) {
+		if (inhabitant->nextTimer == time) return;
+		inhabitant->nextTimer = time;
+	}
+
+	this->schedule(address, time);
+}
+
+template <typename A> void CentralizedNetwork<A>::tickOne(Due& due, Shard& shard) {
+	static const auto drops = Metrics::global().counter("net.drops");
+	static const auto held = Metrics::global().counter("net.uplink_held");
+
+	auto& inhabitant = *due.inhabitant;
+	auto& app = inhabitant.app;
+
+	// handle inbound messages
+	app->tick(this->epoch);
+
+	// The application may be ticked earlier than this if a
+	// message shows up for it.
+	due.next = app->nextWakeup();
+
+	// handle outbound messages
+	inhabitant.uplink.refill(this->linkLimit, this->epoch);
+	auto ready = [&inhabitant]() { return inhabitant.uplink.ready(); };
+	auto send = [this, &inhabitant, &shard](Message<A> message) {
+		this->transmit(inhabitant, std::move(message), shard);
+	};
+
+	shard.open.clear();
+	std::optional<Message<A>> outboundMessage = app->unqueueOut();
+	while (outboundMessage.has_value()) {
+		auto size = outboundMessage->data.size() + this->frameHeader;
+		if (size > this->linkLimit) {
+			Metrics::global().add(drops);
+			logEvent(EventRecord::drop(due.address, size));
+		} else if (inhabitant.transmit.empty() && ready()) {
+			send(std::move(*outboundMessage));
+		} else {
+			inhabitant.transmit.push(std::move(*outboundMessage));
+		}
+		outboundMessage = app->unqueueOut();
+	}
+	inhabitant.transmit.drain(ready, send);
+
+	// Whatever is left goes out in the next epochs.
+	if (!inhabitant.transmit.empty()) {
+		Metrics::global().add(held, inhabitant.transmit.size());
+		logEvent(EventRecord::retry(due.address, inhabitant.transmit.next().data.size()));
+		due.next = this->epoch + 1;
+	}
+}
+
+/** Put a message on the wire. */
+template <typename A>
+void CentralizedNetwork<A>::transmit(Inhabitant& inhabitant, Message<A> message, Shard& shard) {
+	static const auto frames = Metrics::global().counter("net.frames");
+
+	uint64_t size = message.data.size();
+	Metrics::global().messageSent(message.type, size);
+
+	// A message to a peer that already has a frame going out this
+	// epoch rides along in it, without a header of its own. The
+	// frame goes when its last byte does.
+	if (this->coalesce) {
+		auto open = shard.open.find(message.destination);
+		if (open != shard.open.end()) {
+			auto& out = shard.outbox[open->second];
+			out.frame.size += size;
+			out.frame.more.push_back(std::move(message));
+			shard.transferred += size;
+			out.serialization = inhabitant.uplink.take(size, this->linkLimit);
+			return;
+		}
+		shard.open.emplace(message.destination, shard.outbox.size());
+	}
+
+	size += this->frameHeader;
+	Metrics::global().add(frames);
+	shard.transferred += size;
+	Time serialization = inhabitant.uplink.take(size, this->linkLimit);
+	shard.outbox.push_back({Frame{std::move(message), {}, size}, serialization});
+}
+
+template <typename A> void CentralizedNetwork<A>::tickShard(unsigned int index, unsigned int count) {
+	// Shards are contiguous runs of the due list, so reading them
+	// back in shard order gives the same order as one thread would.
+	size_t begin = this->due.size() * index / count;
+	size_t end = this->due.size() * (index + 1) / count;
+	Shard& shard = this->shards[index];
+
+	auto events = event_stream;
+	auto records = event_buffer;
+	auto log = log_stream;
+	event_stream = &shard.events;
+	event_buffer = &shard.records;
+	log_stream = &shard.log;
+	for (size_t i = begin; i < end; i++) {
+		this->tickOne(this->due[i], shard);
+	}
+	event_stream = events;
+	event_buffer = records;
+	log_stream = log;
 }
 
 template <typename A> void CentralizedNetwork<A>::tick() {
-	// Keeps of the total bytes transferred per link
-	unsigned long totalLinkTransfer;
+	// Hand over the messages that arrive this epoch, after the
+	// ones that were already waiting.
+	this->drainDownlinks();
+	this->inTransit.release(this->epoch, [this](Frame& frame) {
+		this->arrive(frame);
+	});
+
+	// Collect everything that is due this epoch, in address order.
+	this->due.clear();
+	while (!this->events.empty() && this->events.top().time <= this->epoch) {
+		A address = this->events.top().address;
+		this->events.pop();
+
+		// The application may have left the network since.
+		auto inhabitant = this->find(address);
+		if (inhabitant == nullptr) continue;
+
+		// Several events can be due at once; one tick handles
+		// all of them.
+		if (inhabitant->lastTick == this->epoch) continue;
+		inhabitant->lastTick = this->epoch;
+
+		this->due.push_back({address, inhabitant, NEVER});
+	}
 
-	// Keeps track of the total bytes transferred during this tick.
+	// Tick them.
+	unsigned int count = std::min<size_t>(this->shards.size(),
+	                                      std::max<size_t>(this->due.size(), 1));
+	this->ticking = true;
+	if (this->pool && count > 1) {
+		this->pool->run(count, [this, count](unsigned int i) { this->tickShard(i, count); });
+	} else {
+		for (unsigned int i = 0; i < count; i++) {
+			this->tickShard(i, count);
+		}
+	}
+	this->ticking = false;
+
+	// End-of-epoch barrier: write out what the shards logged and
+	// exchange their mail.
 	unsigned long totalTransferred = 0;
+	for (unsigned int i = 0; i < count; i++) {
+		Shard& shard = this->shards[i];
+		eventStream() << shard.events.str();
+		logStream() << shard.log.str();
+		shard.events.str("");
+		shard.log.str("");
+		if (!shard.records.empty()) {
+			EventLog::global().append(shard.records);
+			shard.records.clear();
+		}
 
-	// In the following for loop, app is a shared_ptr to the
-	// application
-	for (const auto [address, app] : this->inhabitants) {
-		totalLinkTransfer = 0;
-
-		// handle inbound messages
-		app->tick(this->epoch);
-
-		// handle outbound messages
-		std::optional<Message<A>> outboundMessage = app->unqueueOut();
-		while (outboundMessage.has_value()) {
-			auto size = outboundMessage->data.size();
-			totalLinkTransfer += size;
-			if (size > this->linkLimit) {
-				std::cerr << "DROPPED message of length " << size << std::endl;
-				break;
-			}
-			if (totalLinkTransfer > this->linkLimit) {
-				std::cerr << "RETRYING message of length " << size << std::endl;
-				app->send(*outboundMessage);
-				break;
-			}
-
-			this->passAlongMessage(*outboundMessage);
-
-		        outboundMessage = app->unqueueOut();
+		for (auto& out : shard.outbox) {
+			auto& frame = out.frame;
+			this->sent += 1 + frame.more.size();
+			Time delay = this->latency->latency(frame.message.originator,
+			                                    frame.message.destination);
+			this->inTransit.push(this->epoch + std::max<Time>(delay, 1) + out.serialization,
+			                     std::move(frame));
 		}
+		shard.outbox.clear();
 
-		totalTransferred += totalLinkTransfer;
+		totalTransferred += shard.transferred;
+		shard.transferred = 0;
+	}
 
+	for (const auto& d : this->due) {
+		this->wakeAt(d.address, std::max(d.next, this->epoch + 1));
 	}
 
-	std::cout << "[E] T " << this->epoch << " " << totalTransferred << std::endl;
+	this->transferred += totalTransferred;
+	logEvent(EventRecord::tick(this->epoch, totalTransferred));
+	Metrics::global().endEpoch(this->epoch);
 
 	this->epoch++;
 }
 
-template <typename A> void CentralizedNetwork<A>::passAlongMessage(Message<A> message) {
+/** A frame reached its destination's downlink. */
+template <typename A> void CentralizedNetwork<A>::arrive(Frame& frame) {
+	static const auto held = Metrics::global().counter("net.downlink_held");
+
+	A dest = frame.message.destination;
+	auto inhabitant = this->find(dest);
+	if (inhabitant == nullptr) return;
+
+	inhabitant->downlink.refill(this->downlinkLimit, this->epoch);
+	if (inhabitant->arrivals.empty() && inhabitant->downlink.ready()) {
+		inhabitant->downlink.take(frame.size, this->downlinkLimit);
+		this->deliver(frame);
+		return;
+	}
+
+	Metrics::global().add(held);
+	inhabitant->arrivals.push_back(std::move(frame));
+	if (!inhabitant->congested) {
+		inhabitant->congested = true;
+		this->congested.push_back(dest);
+	}
+}
+
+/** Let through what the downlinks of congested applications can take this epoch. */
+template <typename A> void CentralizedNetwork<A>::drainDownlinks() {
+	size_t kept = 0;
+	for (A address : this->congested) {
+		// It may have left since.
+		auto inhabitant = this->find(address);
+		if (inhabitant == nullptr) continue;
+
+		inhabitant->downlink.refill(this->downlinkLimit, this->epoch);
+		auto& arrivals = inhabitant->arrivals;
+		while (!arrivals.empty() && inhabitant->downlink.ready()) {
+			inhabitant->downlink.take(arrivals.front().size, this->downlinkLimit);
+			this->deliver(arrivals.front());
+			arrivals.pop_front();
+		}
+
+		if (arrivals.empty()) {
+			inhabitant->congested = false;
+		} else {
+			this->congested[kept++] = address;
+		}
+	}
+	this->congested.resize(kept);
+}
+
+/** Unpack a frame into its destination's inqueue. */
+template <typename A> void CentralizedNetwork<A>::deliver(Frame& frame) {
+	A dest = frame.message.destination;
+	auto inhabitant = this->find(dest);
+	if (inhabitant == nullptr) return;
+
+	frame.forEach([inhabitant](Message<A>& message) {
+		message.hops++;
+		inhabitant->app->recv(std::move(message));
+	});
+	this->schedule(dest, this->epoch);
+}
+
+template <typename A> void CentralizedNetwork<A>::deliver(Message<A>& message, Time time) {
 	message.hops++;
 	A dest = message.destination;
-	auto it = this->inhabitants.find(dest);
-	if (it != this->inhabitants.end()) {
-		auto [address, app] = *it;
-		app->recv(message);
+	auto inhabitant = this->find(dest);
+	if (inhabitant != nullptr) {
+		inhabitant->app->recv(std::move(message));
+		this->schedule(dest, time);
 	}
 
 	// The destination doesn't exist on this network, so just drop
 	// the message.
 }
 
+template <typename A> void CentralizedNetwork<A>::passAlongMessage(Message<A> message) {
+	this->deliver(message, this->epoch);
+}
+
+template <typename A>
+void CentralizedNetwork<A>::setLatencyModel(std::unique_ptr<LatencyModel<A>> model) {
+	this->latency = std::move(model);
+}
+
+template <typename A> std::shared_ptr<Application<A>> CentralizedNetwork<A>::get(A address) {
+	auto inhabitant = this->find(address);
+	return inhabitant ? inhabitant->app : nullptr;
+}
+
+template <typename A> void CentralizedNetwork<A>::save(SnapshotWriter& out) {
+	out.pod(this->epoch);
+
+	out.u64(this->inhabitants.size());
+	for (const auto& inhabitant : this->inhabitants) {
+		out.pod(inhabitant.address);
+		out.pod(inhabitant.generation);
+		out.pod(inhabitant.lastTick);
+		out.pod(inhabitant.nextTimer);
+		if (inhabitant.address == 0) continue;
+		out.pod(inhabitant.uplink);
+		out.pod(inhabitant.downlink);
+		inhabitant.transmit.save(out);
+		out.u64(inhabitant.arrivals.size());
+		for (const auto& frame : inhabitant.arrivals) {
+			frame.save(out);
+		}
+		out.pod(inhabitant.congested);
+		inhabitant.app->save(out);
+	}
+	out.pods(this->freeSlots);
+	out.pods(this->congested);
+
+	// Field by field, so that padding doesn't end up in the file.
+	auto events = this->events;
+	out.u64(events.size());
+	for (; !events.empty(); events.pop()) {
+		out.pod(events.top().time);
+		out.pod(events.top().address);
+	}
+
+	out.u64(this->inTransit.size());
+	this->inTransit.forEach([&out](Time time, const Frame& frame) {
+		out.pod(time);
+		frame.save(out);
+	});
+
+	uint64_t seed = 0;
+	Random::Generator* rng = this->latency->generator(seed);
+	out.pod(rng != nullptr);
+	out.u64(seed);
+	if (rng) out.generator(*rng);
+}
+
+template <typename A>
+bool CentralizedNetwork<A>::restore(SnapshotReader& in,
+                                    std::function<std::shared_ptr<Application<A>>()> make) {
+	in.pod(this->epoch);
+
+	uint64_t slots = in.count(4 * sizeof(A));
+	if (slots > SLOT_MASK + 1) in.fail();
+	this->inhabitants.clear();
+	this->inhabitants.resize(in.failed() ? 0 : slots);
+	for (auto& inhabitant : this->inhabitants) {
+		if (in.failed()) break;
+		in.pod(inhabitant.address);
+		in.pod(inhabitant.generation);
+		in.pod(inhabitant.lastTick);
+		in.pod(inhabitant.nextTimer);
+		if (inhabitant.address == 0) continue;
+		in.pod(inhabitant.uplink);
+		in.pod(inhabitant.downlink);
+		inhabitant.transmit.restore(in);
+		uint64_t n = in.count(1);
+		for (uint64_t i = 0; i < n && !in.failed(); i++) {
+			inhabitant.arrivals.emplace_back();
+			inhabitant.arrivals.back().restore(in);
+		}
+		in.pod(inhabitant.congested);
+
+		inhabitant.app = make();
+		inhabitant.app->setAddress(inhabitant.address);
+		inhabitant.app->setScheduler(this);
+		inhabitant.app->restore(in);
+	}
+	in.pods(this->freeSlots);
+	in.pods(this->congested);
+
+	this->events = EventQueue<A>();
+	uint64_t n = in.count(sizeof(Time) + sizeof(A));
+	for (uint64_t i = 0; i < n && !in.failed(); i++) {
+		Time time = in.pod<Time>();
+		this->events.push({time, in.pod<A>()});
+	}
+
+	this->inTransit = DelayLine<Frame>();
+	this->inTransit.skipTo(this->epoch);
+	n = in.count(1);
+	for (uint64_t i = 0; i < n && !in.failed(); i++) {
+		Time time = in.pod<Time>();
+		Frame frame;
+		frame.restore(in);
+		this->inTransit.push(time, std::move(frame));
+	}
+
+	// The latency model carries on drawing where the saved one
+	// left off, if it's the same generator from the same seed. A
+	// different model, or another seed, starts afresh instead.
+	if (in.pod<bool>()) {
+		uint64_t savedSeed = in.u64();
+		Random::Generator saved(savedSeed);
+		in.generator(saved);
+		uint64_t seed = 0;
+		Random::Generator* rng = this->latency->generator(seed);
+		if (rng && seed == savedSeed) {
+			*rng = saved;
+		}
+	} else {
+		in.u64();
+	}
+
+	return !in.failed();
+}
+
 template class dhtsim::CentralizedNetwork<uint32_t>;
@@ -2,33 +2,250 @@
 #define DHTSIM_NETWORK_H
 
 #include "application.hpp"
+#include "scheduler.hpp"
+#include "thread_pool.hpp"
+#include "delay_line.hpp"
+#include "link.hpp"
+#include "snapshot.hpp"
+#include "latency.hpp"
 #include "time.hpp"
 
-#include <map>
+#include <vector>
 #include <cstdint>
 #include <random>
 #include <memory>
+#include <sstream>
+#include <functional>
+#include <unordered_map>
 
 namespace dhtsim {
 /**
  * A simple abstract network. It is parametrized by a numeric type A,
  * which will be the address space. Applications will live in this
  * network.
+ *
+ * The network is event driven: an application is only ticked in an
+ * epoch if a message was delivered to it, it queued something to
+ * send, or it asked to be woken up (see Application::nextWakeup).
+ *
+ * Within an epoch the applications that are due are split into
+ * shards that can be ticked in parallel. Messages sent during the
+ * epoch are collected per shard and handed to the network at the end
+ * of it, so the result does not depend on the number of threads.
+ *
+ * How long a message then takes to arrive is up to the latency
+ * model, one epoch by default. Messages wait in a delay line until
+ * the epoch they arrive in, which costs the same per message however
+ * many are in flight.
+ *
+ * Every node's link has an uplink limit (linkLimit) and a downlink
+ * limit (downlinkLimit) in bytes per epoch. What a node sends beyond
+ * its uplink limit waits in per-destination transmit queues that are
+ * served round-robin; what arrives beyond its downlink limit waits
+ * at the receiver, in arrival order. Bigger messages also take longer
+ * to get onto the wire.
+ *
+ * Messages travel in frames, each of which can cost a header
+ * (frameHeader) on top of what it carries. Normally every message is
+ * a frame of its own; with coalesce set, everything an application
+ * sends to one peer in an epoch shares a frame.
  */
-template <typename A> class CentralizedNetwork {
+template <typename A> class CentralizedNetwork : public Scheduler<A> {
 private:
-	std::map<A, std::shared_ptr<Application<A>>> inhabitants;
+	/**
+	 * What goes over the wire: one message or, when coalescing, all
+	 * the messages an application sent to the same peer in one
+	 * epoch. Frames are unpacked when they're delivered.
+	 */
+	struct Frame {
+		Message<A> message;
+		/** The messages after the first, in the order they were sent. */
+		std::vector<Message<A>> more;
+		/** Bytes on the wire, header included. */
+		uint64_t size = 0;
+
+		template <typename Fn> void forEach(Fn fn) {
+			fn(this->message);
+			for (auto& message : this->more) {
+				fn(message);
+			}
+		}
+
+		void save(SnapshotWriter& out) const {
+			out.pod(this->size);
+			out.message(this->message);
+			out.u64(this->more.size());
+			for (const auto& message : this->more) {
+				out.message(message);
+			}
+		}
+		void restore(SnapshotReader& in) {
+			in.pod(this->size);
+			this->message = in.message<A>();
+			uint64_t n = in.count(1);
+			this->more.clear();
+			for (uint64_t i = 0; i < n && !in.failed(); i++) {
+				this->more.push_back(in.message<A>());
+			}
+		}
+	};
+
+	/**
+	 * Everything the network keeps track of for one
+	 * application. These live in a flat table indexed by the low
+	 * bits of the address; the high bits hold a generation
+	 * counter so that stale addresses of applications that left
+	 * don't reach whoever took over their slot.
+	 */
+	struct Inhabitant {
+		std::shared_ptr<Application<A>> app;
+
+		/** The full address of whoever lives here, 0 if nobody. */
+		A address = 0;
+
+		/** Bumped every time the slot is reused. */
+		A generation = 0;
+
+		/** The last epoch this application was ticked in. */
+		Time lastTick = NEVER;
+
+		/** The last wakeup time the application asked for. */
+		Time nextTimer = NEVER;
+
+		TokenBucket uplink, downlink;
+		/** Messages sent but held back by the uplink. */
+		TransmitQueues<A> transmit;
+		/** Frames that arrived but are held back by the downlink. */
+		std::deque<Frame> arrivals;
+		/** Is this application in the congested list? */
+		bool congested = false;
+	};
+
+	/** An application that is being ticked this epoch. */
+	struct Due {
+		A address;
+		Inhabitant* inhabitant;
+		/** When it wants to be ticked next. */
+		Time next;
+	};
+
+	/** A frame on its way out, and how long it takes to send. */
+	struct Outgoing {
+		Frame frame;
+		Time serialization;
+	};
+
+	/** What one shard produced during an epoch. */
+	struct Shard {
+		/** Frames to hand over at the end of the epoch. */
+		std::vector<Outgoing> outbox;
+		/**
+		 * When coalescing: the frame in the outbox for each
+		 * peer the application being ticked has sent to.
+		 */
+		std::unordered_map<A, size_t> open;
+		unsigned long transferred = 0;
+		std::ostringstream events, log;
+		/** Binary event records, when there's an event log. */
+		std::vector<unsigned char> records;
+	};
+
+	static const unsigned int GENERATION_BITS = 10;
+	static const unsigned int SLOT_BITS = sizeof(A) * 8 - GENERATION_BITS;
+	static constexpr A SLOT_MASK = (A(1) << SLOT_BITS) - 1;
+	static constexpr A GENERATION_MASK = (A(1) << GENERATION_BITS) - 1;
+
+	std::vector<Inhabitant> inhabitants;
+	/** Unused slots in the inhabitants table. */
+	std::vector<A> freeSlots;
         A getNewAddress();
+	/** The inhabitant at this address, or nullptr. */
+	Inhabitant* find(A address);
 	Time epoch;
+
+	/** Applications waiting to be ticked. */
+	EventQueue<A> events;
+
+	/** Are we in the middle of ticking applications? */
+	bool ticking = false;
+
+	std::vector<Due> due;
+	std::vector<Shard> shards;
+	std::unique_ptr<ThreadPool> pool;
+
+	/** Frames on their way, by the epoch they arrive in. */
+	DelayLine<Frame> inTransit;
+	std::unique_ptr<LatencyModel<A>> latency;
+
+	/** Applications with messages held back by their downlink. */
+	std::vector<A> congested;
+
+	/** Bytes and messages sent since the network was made. */
+	unsigned long long transferred = 0, sent = 0;
+
+	void schedule(A address, Time time);
+	void tickShard(unsigned int index, unsigned int count);
+	void tickOne(Due& due, Shard& shard);
+	void transmit(Inhabitant& inhabitant, Message<A> message, Shard& shard);
+	void arrive(Frame& frame);
+	void drainDownlinks();
+	void deliver(Frame& frame);
+	void deliver(Message<A>& message, Time time);
 public:
-	// The bytes-per-tick limit of a single link on this network
+	// The bytes-per-tick limit of a node's uplink on this network
 	unsigned int linkLimit;
-	CentralizedNetwork(unsigned int linkLimit = 1024);
+	// The bytes-per-tick limit of a node's downlink. Set to
+	// linkLimit by the constructor.
+	unsigned int downlinkLimit;
+	// Put all the messages an application sends to the same peer
+	// in an epoch in one frame.
+	bool coalesce = false;
+	// The bytes every frame costs on the wire on top of the
+	// messages in it.
+	unsigned int frameHeader = 0;
+	CentralizedNetwork(unsigned int linkLimit = 1024, unsigned int threads = 1);
+	// Applications hold on to a pointer to the network they're on.
+	CentralizedNetwork(const CentralizedNetwork&) = delete;
+	CentralizedNetwork& operator=(const CentralizedNetwork&) = delete;
+
 	A add(std::shared_ptr<Application<A>> x);
 	void remove(std::shared_ptr<Application<A>> x);
 	void tick();
 	void passAlongMessage(Message<A> message);
+	/** Change how long messages take from now on. */
+	void setLatencyModel(std::unique_ptr<LatencyModel<A>> model);
+	/** The application at this address, or nullptr. */
+	std::shared_ptr<Application<A>> get(A address);
+
+	/**
+	 * Save the network and everybody on it to a snapshot. Only
+	 * call this between ticks.
+	 */
+	void save(SnapshotWriter& out);
+	/**
+	 * Replace this network's contents with what save wrote, on a
+	 * network nobody has joined yet. make is called for every
+	 * application in the snapshot to make an empty one to read it
+	 * into. The limits and the latency model stay as they are set
+	 * on this network, so one snapshot can be run under different
+	 * ones; only a random latency model's generator state is taken
+	 * from the snapshot, if it was seeded the same. Returns false
+	 * if the snapshot is bad.
+	 */
+	bool restore(SnapshotReader& in, std::function<std::shared_ptr<Application<A>>()> make);
         Time current_epoch() { return this->epoch; };
+	/** Bytes sent since the network was made. */
+	unsigned long long bytesTransferred() const { return this->transferred; }
+	/** Messages sent since the network was made. */
+	unsigned long long messagesSent() const { return this->sent; }
+
+	/* Scheduler interface */
+	virtual Time now() { return this->epoch; }
+	virtual void wakeAt(A address, Time time);
+	/** A message and its frame's header have to fit in linkLimit. */
+	virtual size_t maxMessageSize() {
+		return this->linkLimit > this->frameHeader ? this->linkLimit - this->frameHeader : 0;
+	}
 };
 
 
@@ -0,0 +1,170 @@
+#ifndef DHTSIM_PAYLOAD_H
+#define DHTSIM_PAYLOAD_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace dhtsim {
+
+/**
+ * An immutable, reference counted byte buffer. Copying a payload
+ * just bumps the count, so messages can be queued, forwarded and
+ * kept around for retries without copying their contents.
+ *
+ * Buffers come from a per-thread pool of power-of-two size classes,
+ * so in steady state allocating one doesn't hit malloc at all.
+ */
+class Payload {
+public:
+	Payload() : block(nullptr) {}
+	Payload(const Payload& other) : block(other.block) {
+		if (this->block) {
+			this->block->refs.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+	Payload(Payload&& other) : block(other.block) {
+		other.block = nullptr;
+	}
+	Payload& operator=(const Payload& other) {
+		Payload copy(other);
+		std::swap(this->block, copy.block);
+		return *this;
+	}
+	Payload& operator=(Payload&& other) {
+		std::swap(this->block, other.block);
+		return *this;
+	}
+	~Payload() { this->release(); }
+
+	/**
+	 * Allocate a payload of the given size. Its contents may be
+	 * filled in through mutableData() until it is first copied.
+	 */
+	static Payload allocate(size_t size) {
+		Payload p;
+		if (size > 0) {
+			p.block = Pool::get().take(size);
+		}
+		return p;
+	}
+	/** Allocate a payload holding a copy of the given bytes. */
+	static Payload copyOf(const void* bytes, size_t size) {
+		Payload p = allocate(size);
+		if (size > 0) {
+			std::memcpy(p.mutableData(), bytes, size);
+		}
+		return p;
+	}
+	static Payload copyOf(const std::vector<unsigned char>& bytes) {
+		return copyOf(bytes.data(), bytes.size());
+	}
+
+	size_t size() const { return this->block ? this->block->size : 0; }
+	bool empty() const { return this->size() == 0; }
+
+	const unsigned char* data() const {
+		return this->block ? this->block->bytes() : nullptr;
+	}
+	const unsigned char* begin() const { return this->data(); }
+	const unsigned char* end() const { return this->data() + this->size(); }
+
+	/** Only for filling in a freshly allocated payload. */
+	unsigned char* mutableData() {
+		return this->block ? this->block->bytes() : nullptr;
+	}
+
+private:
+	struct Block {
+		std::atomic<uint32_t> refs;
+		uint32_t size;
+		/** Which pool list this goes back to. */
+		uint32_t sizeClass;
+
+		unsigned char* bytes() {
+			return reinterpret_cast<unsigned char*>(this + 1);
+		}
+	};
+
+	/**
+	 * Free lists of blocks, one per size class. Blocks can be
+	 * released on a different thread than the one that allocated
+	 * them; they just end up in that thread's lists.
+	 */
+	class Pool {
+	public:
+		/* Size classes go from 64 bytes to 64KiB. Anything
+		 * bigger goes straight to malloc. */
+		static const unsigned int MIN_SHIFT = 6;
+		static const unsigned int CLASSES = 11;
+		static const uint32_t LARGE = CLASSES;
+		/** How many free blocks to keep per class. */
+		static const size_t MAX_FREE = 4096;
+
+		static Pool& get() {
+			static thread_local Pool pool;
+			return pool;
+		}
+
+		~Pool() {
+			for (auto& list : this->free) {
+				for (auto block : list) {
+					std::free(block);
+				}
+			}
+		}
+
+		Block* take(size_t size) {
+			uint32_t sizeClass = classOf(size);
+			Block* block;
+			if (sizeClass != LARGE && !this->free[sizeClass].empty()) {
+				block = this->free[sizeClass].back();
+				this->free[sizeClass].pop_back();
+			} else {
+				size_t capacity = sizeClass == LARGE ? size : (size_t(1) << (sizeClass + MIN_SHIFT));
+				block = static_cast<Block*>(std::malloc(sizeof(Block) + capacity));
+				new (&block->refs) std::atomic<uint32_t>();
+				block->sizeClass = sizeClass;
+			}
+			block->refs.store(1, std::memory_order_relaxed);
+			block->size = size;
+			return block;
+		}
+
+		void give(Block* block) {
+			if (block->sizeClass == LARGE || this->free[block->sizeClass].size() >= MAX_FREE) {
+				std::free(block);
+				return;
+			}
+			this->free[block->sizeClass].push_back(block);
+		}
+
+	private:
+		static uint32_t classOf(size_t size) {
+			uint32_t sizeClass = 0;
+			while (sizeClass < CLASSES && (size_t(1) << (sizeClass + MIN_SHIFT)) < size) {
+				sizeClass++;
+			}
+			return sizeClass;
+		}
+
+		std::vector<Block*> free[CLASSES];
+	};
+
+	void release() {
+		if (this->block && this->block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			Pool::get().give(this->block);
+		}
+		this->block = nullptr;
+	}
+
+	Block* block;
+};
+
+}
+
+#endif
@@ -27,9 +27,8 @@ public:
 
 template <typename A> void PingOnlyApplication<A>::ping(A other, MessageCallbackSet callback) {
 	auto tag = this->randomTag();
-	std::vector<unsigned char> data;
-	Message<A> m(PM_PING, this->getAddress(), other, tag, data);
-	this->send(m, callback);
+	Message<A> m(PM_PING, this->getAddress(), other, tag);
+	this->send(std::move(m), callback);
 }
 
 
@@ -42,7 +41,7 @@ template <typename A> void PingOnlyApplication<A>::handleMessage(const Message<A
 		resp.type = PM_PONG;
 		resp.destination = m.originator;
 		resp.originator = this->getAddress();
-		this->send(resp);
+		this->send(std::move(resp));
 		break;
 	case PM_PONG:
 		// Received a pong.
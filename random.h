@@ -144,10 +144,19 @@ namespace Random
         
         // -------------------------------------------------------------------- Utility
         bool Chance ( float probability ) { return Float_01() < probability; }
+        
+        // -------------------------------------------------------------------- State
+        // The distributions hold no state, so this is all there is to save.
+        std::mt19937_64&       Engine ()       { return _engine; }
+        const std::mt19937_64& Engine () const { return _engine; }
     };
 }
 
 namespace dhtsim {
-	static Random::Generator global_rng(1234);
+	// The generator of whichever simulation the current thread is
+	// running, so a sweep can run several at once. Anything that
+	// runs inside a network tick uses its application's own
+	// generator instead.
+	inline thread_local Random::Generator global_rng(1234);
 }
 #endif
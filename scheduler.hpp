@@ -0,0 +1,66 @@
+#ifndef DHTSIM_SCHEDULER_H
+#define DHTSIM_SCHEDULER_H
+
+#include "time.hpp"
+
+#include <queue>
+#include <vector>
+#include <functional>
+#include <limits>
+
+namespace dhtsim {
+
+/** A time that never comes. Used for "nothing scheduled". */
+static const Time NEVER = std::numeric_limits<Time>::max();
+
+/**
+ * Something that keeps the time and wakes applications up when they
+ * have work to do. The network implements this so that it only has
+ * to tick the applications that have something to do in a given
+ * epoch instead of all of them.
+ */
+template <typename A> class Scheduler {
+public:
+	virtual ~Scheduler() = default;
+
+	/** The current time, measured as network ticks since startup. */
+	virtual Time now() = 0;
+
+	/**
+	 * Ask for the application at the given address to be ticked
+	 * no earlier than the given time.
+	 */
+	virtual void wakeAt(A address, Time time) = 0;
+
+	/**
+	 * The most bytes a single message's data can have and still
+	 * be delivered. Bigger messages are dropped.
+	 */
+	virtual size_t maxMessageSize() { return std::numeric_limits<size_t>::max(); }
+};
+
+/**
+ * One entry in the event queue: "tick the application at this
+ * address at this time". Message deliveries, retry deadlines and
+ * periodic maintenance all boil down to one of these; what actually
+ * happens is up to the application's tick.
+ */
+template <typename A> struct Event {
+	Time time;
+	A address;
+
+	/* Events are processed in time order, and within the same
+	 * epoch in address order. */
+	friend bool operator>(const Event& l, const Event& r) {
+		if (l.time != r.time) return l.time > r.time;
+		return l.address > r.address;
+	}
+};
+
+template <typename A>
+using EventQueue = std::priority_queue<Event<A>, std::vector<Event<A>>,
+                                       std::greater<Event<A>>>;
+
+}
+
+#endif
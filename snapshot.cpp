@@ -0,0 +1,114 @@
+#include "snapshot.hpp"
+
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace dhtsim;
+
+SnapshotWriter::~SnapshotWriter() {
+	this->close();
+}
+
+bool SnapshotWriter::open(const std::string& path) {
+	this->close();
+	this->file = std::fopen(path.c_str(), "wb");
+	if (this->file == nullptr) {
+		return false;
+	}
+	this->bad = false;
+	this->bytes(MAGIC, MAGIC_LEN);
+	return true;
+}
+
+bool SnapshotWriter::close() {
+	if (this->file == nullptr) return !this->bad;
+	if (std::fclose(this->file) != 0) {
+		this->bad = true;
+	}
+	this->file = nullptr;
+	return !this->bad;
+}
+
+void SnapshotWriter::bytes(const void* data, size_t size) {
+	if (this->file == nullptr || size == 0) return;
+	if (std::fwrite(data, 1, size, this->file) != size) {
+		this->bad = true;
+	}
+}
+
+/*
+ * The standard library only lets a Mersenne twister out as text, so
+ * the state words are parsed out of that and written as numbers,
+ * which is a third of the size.
+ */
+void SnapshotWriter::generator(Random::Generator& rng) {
+	std::stringstream text;
+	text << rng.Engine();
+	std::vector<uint64_t> words;
+	uint64_t word;
+	while (text >> word) {
+		words.push_back(word);
+	}
+	this->pods(words);
+}
+
+SnapshotReader::~SnapshotReader() {
+	if (this->map) {
+		munmap((void*) this->map, this->size);
+	}
+}
+
+bool SnapshotReader::open(const std::string& path) {
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || size_t(st.st_size) < SnapshotWriter::MAGIC_LEN) {
+		::close(fd);
+		return false;
+	}
+	void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	// The mapping keeps the file open.
+	::close(fd);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+	this->map = (const unsigned char*) map;
+	this->size = st.st_size;
+	this->pos = 0;
+
+	const unsigned char* magic = this->bytes(SnapshotWriter::MAGIC_LEN);
+	if (std::memcmp(magic, SnapshotWriter::MAGIC, SnapshotWriter::MAGIC_LEN) != 0) {
+		this->bad = true;
+		return false;
+	}
+	return true;
+}
+
+const unsigned char* SnapshotReader::bytes(size_t size) {
+	if (this->bad || this->map == nullptr || size > this->size - this->pos) {
+		this->bad = true;
+		return nullptr;
+	}
+	const unsigned char* data = this->map + this->pos;
+	this->pos += size;
+	return data;
+}
+
+void SnapshotReader::generator(Random::Generator& rng) {
+	std::vector<uint64_t> words;
+	this->pods(words);
+	if (this->bad) return;
+	std::stringstream text;
+	for (auto word : words) {
+		text << word << " ";
+	}
+	text >> rng.Engine();
+	if (text.fail()) {
+		this->bad = true;
+	}
+}
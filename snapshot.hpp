@@ -0,0 +1,155 @@
+#ifndef DHTSIM_SNAPSHOT_H
+#define DHTSIM_SNAPSHOT_H
+
+#include "message.hpp"
+#include "random.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <type_traits>
+#include <cstring>
+
+namespace dhtsim {
+
+/**
+ * Writes a snapshot of the simulation: a file header followed by
+ * whatever the network, the applications and the experiment save,
+ * in the order they save it.
+ *
+ * Numbers and plain structures are written as they are in memory, so
+ * a snapshot can only be read back by the same build on the same
+ * kind of machine. Everything else is built from those: a vector is
+ * its length and then its elements.
+ *
+ * The number in MAGIC goes up whenever what is saved changes shape,
+ * including the wire format of a message type (queued and pending
+ * messages are saved as their payloads), so that an older file is
+ * turned away instead of misread.
+ */
+class SnapshotWriter {
+public:
+	static constexpr const char* MAGIC = "DHTSNP2\n";
+	static const size_t MAGIC_LEN = 8;
+
+	~SnapshotWriter();
+
+	/** Start writing to the given file. Returns false on failure. */
+	bool open(const std::string& path);
+	/** Finish the file. Returns false if anything failed to write. */
+	bool close();
+
+	void bytes(const void* data, size_t size);
+
+	template <typename T> void pod(const T& value) {
+		static_assert(std::is_trivially_copyable<T>::value, "not a plain value");
+		this->bytes(&value, sizeof(value));
+	}
+	void u64(uint64_t value) { this->pod(value); }
+
+	template <typename T> void pods(const std::vector<T>& values) {
+		this->u64(values.size());
+		this->bytes(values.data(), values.size() * sizeof(T));
+	}
+	void blob(const unsigned char* data, size_t size) {
+		this->u64(size);
+		this->bytes(data, size);
+	}
+	void blob(const std::vector<unsigned char>& data) { this->blob(data.data(), data.size()); }
+
+	template <typename A> void message(const Message<A>& m) {
+		this->pod(m.type);
+		this->pod(m.originator);
+		this->pod(m.destination);
+		this->pod(m.tag);
+		this->pod(m.hops);
+		this->blob(m.data.data(), m.data.size());
+	}
+
+	void generator(Random::Generator& rng);
+
+private:
+	std::FILE* file = nullptr;
+	bool bad = false;
+};
+
+/**
+ * Reads a snapshot back. The file is memory-mapped rather than read,
+ * so opening even a big one costs next to nothing and the pages come
+ * in as they're needed.
+ *
+ * Reading past the end, or anything that doesn't make sense, marks
+ * the reader as failed; after that every read gives zeroes and empty
+ * vectors, so callers can read a whole structure and check failed()
+ * once at the end.
+ */
+class SnapshotReader {
+public:
+	~SnapshotReader();
+
+	/** Returns false if the file can't be mapped or isn't a snapshot. */
+	bool open(const std::string& path);
+
+	bool failed() const { return this->bad; }
+	/** Mark the snapshot as bad, e.g. because a value made no sense. */
+	void fail() { this->bad = true; }
+	/** Is everything read? */
+	bool done() const { return this->pos == this->size; }
+
+	/** The next size bytes, in the mapping, or nullptr. */
+	const unsigned char* bytes(size_t size);
+
+	template <typename T> T pod() {
+		static_assert(std::is_trivially_copyable<T>::value, "not a plain value");
+		T value{};
+		const unsigned char* data = this->bytes(sizeof(T));
+		if (data) std::memcpy(&value, data, sizeof(T));
+		return value;
+	}
+	template <typename T> void pod(T& value) { value = this->pod<T>(); }
+	uint64_t u64() { return this->pod<uint64_t>(); }
+
+	/** A count of things of the given size, checked against what's left. */
+	uint64_t count(size_t itemSize) {
+		uint64_t n = this->u64();
+		if (itemSize > 0 && n > (this->size - this->pos) / itemSize) {
+			this->bad = true;
+			return 0;
+		}
+		return n;
+	}
+
+	template <typename T> void pods(std::vector<T>& values) {
+		uint64_t n = this->count(sizeof(T));
+		const unsigned char* data = this->bytes(n * sizeof(T));
+		values.resize(data ? n : 0);
+		if (data && n > 0) std::memcpy(values.data(), data, n * sizeof(T));
+	}
+	void blob(std::vector<unsigned char>& data) { this->pods(data); }
+
+	template <typename A> Message<A> message() {
+		Message<A> m;
+		this->pod(m.type);
+		this->pod(m.originator);
+		this->pod(m.destination);
+		this->pod(m.tag);
+		this->pod(m.hops);
+		uint64_t n = this->count(1);
+		const unsigned char* data = this->bytes(n);
+		if (data) m.data = Payload::copyOf(data, n);
+		return m;
+	}
+
+	void generator(Random::Generator& rng);
+
+private:
+	const unsigned char* map = nullptr;
+	size_t size = 0;
+	size_t pos = 0;
+	bool bad = false;
+};
+
+}
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef DHTSIM_THREAD_POOL_H
+#define DHTSIM_THREAD_POOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+namespace dhtsim {
+
+/**
+ * A fixed set of worker threads that run one batch of jobs at a
+ * time. The calling thread takes part too, so a pool of size n
+ * starts n-1 threads.
+ */
+class ThreadPool {
+public:
+	using Job = std::function<void(unsigned int)>;
+
+	ThreadPool(unsigned int size) {
+		for (unsigned int i = 1; i < size; i++) {
+			this->workers.emplace_back([this, i]() { this->work(i); });
+		}
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->stopping = true;
+		}
+		this->start.notify_all();
+		for (auto& worker : this->workers) {
+			worker.join();
+		}
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	/**
+	 * Run job(i) for every i in [0, n) and wait for all of them
+	 * to finish. n must not be larger than the size of the pool.
+	 */
+	void run(unsigned int n, const Job& job) {
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->job = &job;
+			this->jobs = n;
+			this->pending = n - 1;
+			this->generation++;
+		}
+		this->start.notify_all();
+
+		job(0);
+
+		std::unique_lock<std::mutex> lock(this->mutex);
+		this->done.wait(lock, [this]() { return this->pending == 0; });
+		this->job = nullptr;
+	}
+
+private:
+	void work(unsigned int index) {
+		unsigned long seen = 0;
+		while (true) {
+			const Job* current;
+			{
+				std::unique_lock<std::mutex> lock(this->mutex);
+				this->start.wait(lock, [this, seen]() {
+					return this->stopping || this->generation != seen;
+				});
+				if (this->stopping) return;
+				seen = this->generation;
+				if (index >= this->jobs) continue;
+				current = this->job;
+			}
+
+			(*current)(index);
+
+			{
+				std::lock_guard<std::mutex> lock(this->mutex);
+				this->pending--;
+			}
+			this->done.notify_one();
+		}
+	}
+
+	std::vector<std::thread> workers;
+
+	std::mutex mutex;
+	std::condition_variable start, done;
+
+	const Job* job = nullptr;
+	unsigned int jobs = 0;
+	unsigned int pending = 0;
+	unsigned long generation = 0;
+	bool stopping = false;
+};
+
+}
+
+#endif
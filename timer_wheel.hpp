@@ -0,0 +1,198 @@
+#ifndef DHTSIM_TIMER_WHEEL_H
+#define DHTSIM_TIMER_WHEEL_H
+
+#include "time.hpp"
+#include "scheduler.hpp"
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+namespace dhtsim {
+
+/**
+ * A hierarchical timing wheel. Each value is filed under the time it
+ * is due, and advance() hands back everything that has come due. The
+ * cost of advancing is proportional to the number of timers that
+ * expire (or move down a level), not to the number of timers
+ * outstanding.
+ *
+ * Level l has 64 slots, each covering 64^l ticks. A timer goes on
+ * the level of the highest 6-bit digit in which its time differs
+ * from the wheel's current time; as the clock catches up, timers
+ * cascade down to lower levels until they expire. A bitmap per level
+ * keeps track of which slots are in use, so empty stretches of time
+ * are skipped over.
+ */
+template <typename T> class TimerWheel {
+public:
+	TimerWheel() : current(0), count(0), occupied() {}
+
+	/** File value under the given time. */
+	void schedule(Time time, const T& value) {
+		this->count++;
+		this->place({time, value});
+	}
+
+	/**
+	 * Remove a value that was filed under the given time. Returns
+	 * false if it wasn't there.
+	 */
+	bool cancel(Time time, const T& value) {
+		std::vector<Entry>* list;
+		unsigned int level = this->levelOf(time);
+		if (time <= this->current) {
+			list = &this->ready;
+		} else if (level >= LEVELS) {
+			list = &this->overflow;
+		} else {
+			list = &this->slots[level][this->slotOf(time, level)];
+		}
+
+		for (auto it = list->begin(); it != list->end(); it++) {
+			if (it->time == time && it->value == value) {
+				*it = list->back();
+				list->pop_back();
+				if (level < LEVELS && list->empty() && time > this->current) {
+					this->occupied[level] &= ~(uint64_t(1) << this->slotOf(time, level));
+				}
+				this->count--;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/**
+	 * Move the clock forward to now and append every value that
+	 * is due by then to expired.
+	 */
+	void advance(Time now, std::vector<T>& expired) {
+		for (const auto& entry : this->ready) {
+			expired.push_back(entry.value);
+		}
+		this->count -= this->ready.size();
+		this->ready.clear();
+
+		if (now <= this->current) return;
+		Time old = this->current;
+		this->current = now;
+
+		for (unsigned int level = 0; level < LEVELS; level++) {
+			unsigned int shift = level * BITS;
+			// Slots are numbered in time order, so we can stop
+			// at the first one that starts after now.
+			Time high = (old >> (shift + BITS)) << (shift + BITS);
+			while (this->occupied[level] != 0) {
+				unsigned int slot = __builtin_ctzll(this->occupied[level]);
+				Time start = high | (Time(slot) << shift);
+				if (start > now) break;
+
+				this->occupied[level] &= ~(uint64_t(1) << slot);
+				std::vector<Entry> entries;
+				std::swap(entries, this->slots[level][slot]);
+				this->expireOrPlace(entries, expired);
+				// Hand the storage back to the slot.
+				entries.clear();
+				if (this->slots[level][slot].empty()) {
+					std::swap(entries, this->slots[level][slot]);
+				}
+			}
+		}
+
+		// Far-away timers only need looking at when the top
+		// digits of the clock change.
+		if ((old >> (LEVELS * BITS)) != (now >> (LEVELS * BITS))) {
+			std::vector<Entry> entries;
+			std::swap(entries, this->overflow);
+			this->expireOrPlace(entries, expired);
+		}
+	}
+
+	/** The earliest time something is filed under, or NEVER. */
+	Time next() const {
+		if (!this->ready.empty()) {
+			return this->current;
+		}
+		for (unsigned int level = 0; level < LEVELS; level++) {
+			if (this->occupied[level] == 0) continue;
+			// Everything on a lower level comes before
+			// everything on a higher one, and slots are in
+			// time order.
+			unsigned int slot = __builtin_ctzll(this->occupied[level]);
+			return earliest(this->slots[level][slot]);
+		}
+		return earliest(this->overflow);
+	}
+
+	bool empty() const { return this->count == 0; }
+	size_t size() const { return this->count; }
+
+private:
+	static const unsigned int BITS = 6;
+	static const unsigned int SLOTS = 1 << BITS;
+	static const unsigned int LEVELS = 6;
+
+	struct Entry {
+		Time time;
+		T value;
+	};
+
+	unsigned int levelOf(Time time) const {
+		Time diff = time ^ this->current;
+		if (diff == 0) return 0;
+		return (63 - __builtin_clzll(diff)) / BITS;
+	}
+	static unsigned int slotOf(Time time, unsigned int level) {
+		return (time >> (level * BITS)) & (SLOTS - 1);
+	}
+
+	static Time earliest(const std::vector<Entry>& entries) {
+		Time result = NEVER;
+		for (const auto& entry : entries) {
+			result = std::min(result, entry.time);
+		}
+		return result;
+	}
+
+	void place(const Entry& entry) {
+		if (entry.time <= this->current) {
+			this->ready.push_back(entry);
+			return;
+		}
+		unsigned int level = this->levelOf(entry.time);
+		if (level >= LEVELS) {
+			this->overflow.push_back(entry);
+			return;
+		}
+		unsigned int slot = slotOf(entry.time, level);
+		this->slots[level][slot].push_back(entry);
+		this->occupied[level] |= uint64_t(1) << slot;
+	}
+
+	void expireOrPlace(const std::vector<Entry>& entries, std::vector<T>& expired) {
+		for (const auto& entry : entries) {
+			if (entry.time <= this->current) {
+				expired.push_back(entry.value);
+				this->count--;
+			} else {
+				this->place(entry);
+			}
+		}
+	}
+
+	Time current;
+	size_t count;
+
+	std::vector<Entry> slots[LEVELS][SLOTS];
+	uint64_t occupied[LEVELS];
+
+	/** Timers that were already due when they were filed. */
+	std::vector<Entry> ready;
+	/** Timers too far away for the top level. */
+	std::vector<Entry> overflow;
+};
+
+}
+
+#endif
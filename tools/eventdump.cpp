@@ -0,0 +1,32 @@
+#include <iostream>
+
+#include "event_log.hpp"
+
+using namespace dhtsim;
+
+/*
+ * Print a binary event log (written with --events=FILE) in the same
+ * "[E] ..." text format the simulator prints when it isn't given one.
+ */
+int main(int argc, char* argv[]) {
+	if (argc != 2) {
+		std::cerr << "usage: " << argv[0] << " EVENTS_FILE" << std::endl;
+		return 2;
+	}
+
+	EventReader reader;
+	if (!reader.open(argv[1])) {
+		std::cerr << argv[1] << ": not an event log" << std::endl;
+		return 1;
+	}
+
+	EventRecord event;
+	while (reader.next(event)) {
+		event.writeText(std::cout);
+	}
+	if (reader.failed()) {
+		std::cerr << argv[1] << ": bad record, stopping" << std::endl;
+		return 1;
+	}
+	return 0;
+}